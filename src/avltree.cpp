@@ -4,21 +4,114 @@
  * To check results using Graphviz, launch using the following command:
  *
  *     $ ./avltree | xdot -
+ *
+ * Benchmarks run with the following command, preferably on a Release
+ * build (cmake -DCMAKE_BUILD_TYPE=Release):
+ *
+ *     $ ./avltree bench [count]
  */
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <cstddef>
 #include <cstring>
 #include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <future>
 #include <cstdlib>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <ostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+/**
+ * Sub-tree size of a node, only stored when the tree needs order
+ * statistics (see AVLTree::select).
+ */
+template<bool Ranked>
+class NodeSize
+{
+public:
+	NodeSize() : m_size(1) {}
+
+	/**
+	 * Return the number of elements of the sub-tree rooted at this
+	 * node.
+	 */
+	std::size_t get_size() const {return m_size;}
+
+	/**
+	 * Change the sub-tree size.
+	 */
+	void set_size(std::size_t size) {m_size = size;}
+
+private:
+	std::size_t m_size;
+};
+
+template<>
+class NodeSize<false>
+{
+};
+
+
+/**
+ * Number of equivalent elements held by a node, only stored in
+ * multiset mode (see AVLTree). Otherwise a node always holds one
+ * element.
+ */
+template<bool Multi>
+class NodeCount
+{
+public:
+	NodeCount() : m_count(1) {}
+
+	/**
+	 * Return the number of elements held by the node.
+	 */
+	std::size_t get_count() const {return m_count;}
+
+	/**
+	 * Change the number of elements held by the node.
+	 */
+	void set_count(std::size_t count) {m_count = count;}
+
+private:
+	std::size_t m_count;
+};
+
+template<>
+class NodeCount<false>
+{
+public:
+	std::size_t get_count() const {return 1;}
+	void set_count(std::size_t) {}
+};
 
 
 /**
  * Node class
  */
-template<class T>
-class Node
+template<class T, bool Ranked=false, bool Multi=false>
+class Node : public NodeSize<Ranked>, public NodeCount<Multi>
 {
 public:
 	/**
@@ -36,17 +129,45 @@ public:
 		m_right(nullptr)
 	{}
 
+	/**
+	 * Node constructor moving the payload.
+	 */
+	Node(T &&data, Node * = nullptr) :
+		m_data(std::move(data)),
+		m_depth(1),
+		m_left(nullptr),
+		m_right(nullptr)
+	{}
+
+	/**
+	 * Tag of the in place constructor.
+	 */
+	struct in_place_t {};
+
+	/**
+	 * Node constructor building the payload in place from args.
+	 */
+	template<class... Args>
+	Node(in_place_t, Args&&... args) :
+		m_data(std::forward<Args>(args)...),
+		m_depth(1),
+		m_left(nullptr),
+		m_right(nullptr)
+	{}
+
 	/**
 	 * Node destructor. The destructor must not free left or right.
 	 * sub-nodes. During remove operation, child of removed node must
-	 * not be deleted.
+	 * not be deleted. It stays trivial whenever T is, so that a
+	 * NodePool can drop a whole tree without visiting its nodes.
 	 */
-	~Node() {}
+	~Node() = default;
 
 	/**
 	 * Return the node payload.
 	 */
 	const T &get_data() const {return m_data;}
+	T &get_data() {return m_data;}
 
 	/**
 	 * Change the node's payload.
@@ -92,6 +213,7 @@ public:
 			rd = m_right->get_depth();
 
 		set_depth(std::max(ld, rd) + 1);
+		update_size(std::integral_constant<bool, Ranked>());
 	}
 
 	/**
@@ -130,12 +252,31 @@ private:
 	 * Overload of the operator<<. This method call the recursive
 	 * function to_dot_recurse that scan the wall sub-nodes.
 	 */
-	friend std::ostream & operator<<(std::ostream &os, const Node<T> &p)
+	friend std::ostream & operator<<(std::ostream &os, const Node &p)
 	{
 		p.to_dot_recurse(os);
 		return os;
 	}
 
+	/**
+	 * Update the sub-tree size along with the depth, so that every
+	 * rotation keeps it right.
+	 */
+	void update_size(std::true_type)
+	{
+		std::size_t size = this->get_count();
+
+		if (m_left)
+			size += m_left->get_size();
+
+		if (m_right)
+			size += m_right->get_size();
+
+		this->set_size(size);
+	}
+
+	void update_size(std::false_type) {}
+
 	/**
 	 * Go through the tree to print all payloads in the dot format
 	 * (Graphviz). The dot header of the diagram is not managed here.
@@ -186,415 +327,3424 @@ private:
 
 
 /**
- * AVL Tree class.
+ * Node allocator policy based on the global new and delete
+ * operators. Each node is a separate heap allocation.
  *
- * It points to a Node root.
+ * A node allocator policy must provide:
+ *
+ * - create(args...): construct a node and return a pointer on it.
+ * - destroy(node): destruct a node and give its memory back.
+ * - release(): free the memory of all nodes at once, without calling
+ *   any destructor.
+ * - operator==: true if nodes of one allocator can be freed by the
+ *   other, so that nodes can be moved from one tree to another.
+ * - adopt(other): take ownership of the nodes of another allocator of
+ *   the same type, when they move from one tree to another.
+ * - bulk_release: true if release() is enough to free a whole tree,
+ *   false if the tree must be walked to destroy each node first.
  */
-template<class T>
-class AVLTree
+template<class N>
+class HeapAllocator
 {
 public:
-	/**
-	 * AVLTree constructor
-	 */
-	AVLTree() :	m_head (nullptr) {}
+	static constexpr bool bulk_release = false;
 
-	/**
-	 * AVLTree destructor. Free all nodes recursively.
-	 */
-	~AVLTree()
+	template<class... Args>
+	N *create(Args&&... args)
 	{
-		if(m_head) {
-			delete_recurse(m_head);
+		return new N(std::forward<Args>(args)...);
+	}
+
+	void destroy(N *node)
+	{
+		delete node;
+	}
+
+	void release() {}
+
+	void adopt(HeapAllocator &) {}
+
+	bool operator==(const HeapAllocator &) const {return true;}
+};
+
+
+/**
+ * Node allocator policy that hands out nodes from contiguous blocks
+ * (slabs). Destroyed nodes are recycled through a free list, and all
+ * the blocks are freed in one go when the pool is released, which
+ * costs O(blocks) instead of O(nodes).
+ *
+ * The pool is not thread safe and belongs to a single tree.
+ */
+template<class N>
+class NodePool
+{
+public:
+	static constexpr bool bulk_release = std::is_trivially_destructible<N>::value;
+
+	NodePool() :
+		m_blocks(nullptr),
+		m_free(nullptr),
+		m_next(nullptr),
+		m_end(nullptr),
+		m_block_slots(min_block_slots)
+	{}
+
+	NodePool(const NodePool &) = delete;
+	NodePool &operator=(const NodePool &) = delete;
+
+	~NodePool()
+	{
+		release();
+	}
+
+	template<class... Args>
+	N *create(Args&&... args)
+	{
+		Slot *slot = m_free;
+		if (slot) {
+			m_free = slot->next;
+		}
+		else {
+			if (m_next == m_end) {
+				grow();
+			}
+			slot = m_next++;
 		}
+
+		return new (&slot->storage) N(std::forward<Args>(args)...);
 	}
 
-	/**
-	 * Print to the dot format the tree. Payload T must implements the
-	 * operator<< overloading.
-	 */
-	void to_dot(const std::string &graph_name="to_dot") const
+	void destroy(N *node)
 	{
-		if(m_head) {
-			m_head->to_dot(std::cout, graph_name);
+		node->~N();
+		Slot *slot = reinterpret_cast<Slot *>(node);
+		slot->next = m_free;
+		m_free = slot;
+	}
+
+	void release()
+	{
+		while (m_blocks) {
+			Block *next = m_blocks->next;
+			::operator delete(m_blocks);
+			m_blocks = next;
 		}
+
+		m_free = nullptr;
+		m_next = m_end = nullptr;
+		m_block_slots = min_block_slots;
 	}
 
+	bool operator==(const NodePool &other) const {return this == &other;}
+
 	/**
-	 * Insert an element in the tree. Keep the node sorted. The
-	 * insertion can execute one rotation after insertion to keep the
-	 * tree properly balanced.
+	 * Take the blocks and the free slots of other, which is left
+	 * empty. The slots not yet handed out from the current block of
+	 * other are only reclaimed by release().
 	 */
-	AVLTree<T> &push(const T &value)
+	void adopt(NodePool &other)
 	{
-		m_head = push_recurse(m_head, value);
-		return *this;
+		if (!other.m_blocks) return;
+
+		Block *last = other.m_blocks;
+		while (last->next) {
+			last = last->next;
+		}
+		last->next = m_blocks;
+		m_blocks = other.m_blocks;
+
+		if (other.m_free) {
+			Slot *tail = other.m_free;
+			while (tail->next) {
+				tail = tail->next;
+			}
+			tail->next = m_free;
+			m_free = other.m_free;
+		}
+
+		other.m_blocks = nullptr;
+		other.m_free = nullptr;
+		other.m_next = other.m_end = nullptr;
+		other.m_block_slots = min_block_slots;
 	}
 
+private:
 	/**
-	 * Remove an element in the tree. It can execute a rotation during
-	 * the ascent of each parent until the root after the node deletion.
+	 * A slot is either a live node or a link of the free list.
 	 */
-	AVLTree<T> &remove(const T &value)
-	{
-		m_head = remove_recurse(m_head, value);
-		return *this;
-	}
+	union Slot {
+		Slot *next;
+		typename std::aligned_storage<sizeof(N), alignof(N)>::type storage;
+	};
 
 	/**
-	 * Check if the tree violates the AVL property. Return the number
-	 * of errors found.
+	 * Block header, followed in memory by its slots.
 	 */
-	std::size_t check() const {
-		return check_recurse(m_head);
-	}
+	struct Block {
+		Block *next;
+	};
 
+	static constexpr std::size_t min_block_slots = 64;
+	static constexpr std::size_t max_block_slots = 65536;
 
-private:
+	/**
+	 * Offset of the first slot from the beginning of a block.
+	 */
+	static constexpr std::size_t slots_offset =
+		(sizeof(Block) + alignof(Slot) - 1) / alignof(Slot) * alignof(Slot);
 
 	/**
-	 * Free the sub-nodes recursively and the given node.
+	 * Allocate a new block. The block size doubles each time up to
+	 * max_block_slots, so small trees stay small and large trees use
+	 * few blocks.
 	 */
-	void delete_recurse(Node<T> *node)
+	void grow()
 	{
-		if (node) {
-			delete_recurse(node->get_left());
-			delete_recurse(node->get_right());
-			delete node;
+		static_assert(alignof(Slot) <= alignof(std::max_align_t),
+		              "over-aligned nodes are not supported");
+
+		char *raw = static_cast<char *>(::operator new(slots_offset + m_block_slots * sizeof(Slot)));
+		Block *block = reinterpret_cast<Block *>(raw);
+		block->next = m_blocks;
+		m_blocks = block;
+
+		m_next = reinterpret_cast<Slot *>(raw + slots_offset);
+		m_end = m_next + m_block_slots;
+
+		if (m_block_slots < max_block_slots) {
+			m_block_slots *= 2;
 		}
 	}
 
+private:
+	Block *m_blocks;
+	Slot *m_free;
+	Slot *m_next;
+	Slot *m_end;
+	std::size_t m_block_slots;
+};
+
+/**
+ * Header of the binary file written by AVLTree::save. The elements
+ * follow in order, as raw bytes, right after the header.
+ */
+struct AVLFileHeader
+{
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t element_size;
+	std::uint64_t count;
+	// Padding so that the elements start on a cache line.
+	char reserved[40];
+};
+
+static const char avl_file_magic[8] = {'A', 'V', 'L', 'T', 'R', 'E', 'E', '\0'};
+static const std::uint32_t avl_file_version = 1;
+
+
+/**
+ * Read-only memory mapping of a file written by AVLTree::save.
+ *
+ * The elements are stored sorted, so the file can be queried in place
+ * by binary search without being loaded: pages are only read from the
+ * disk when a lookup touches them. It is also the fast path of
+ * AVLTree::load.
+ */
+template<class T>
+class MappedAVLFile
+{
+public:
+	static_assert(std::is_trivially_copyable<T>::value,
+	              "only trivially copyable elements can be mapped");
+
 	/**
-	 * Left rotation
-	 *
-	 * The node has a 2 sub-tree depth difference and
-	 * the right son a 1 difference.
-	 *
-	 *      from:   Y         to:    X
-	 *             / \              / \
-	 *            a   X            Y   c
-	 *               / \          / \  c
-	 *              b   c        a   b
-	 *                  c
+	 * Map the file. Throw std::runtime_error if it cannot be opened or
+	 * is not a file of T elements.
 	 */
-	Node<T> *rotate_left(Node<T> *node) const
+	explicit MappedAVLFile(const std::string &path) :
+		m_map(MAP_FAILED),
+		m_length(0)
 	{
-		Node<T> *Y = node;
-		Node<T> *X = Y->get_right();
-		Node<T> *a = Y->get_left();
-		Node<T> *b = X->get_left();
-		Node<T> *c = X->get_right();
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			throw std::runtime_error("MappedAVLFile: cannot open " + path);
+		}
 
-		Y->set_left(a);
-		Y->set_right(b);
-		Y->update_depth();
+		struct stat st;
+		if (::fstat(fd, &st) == 0 && std::size_t(st.st_size) >= sizeof(AVLFileHeader)) {
+			m_length = st.st_size;
+			m_map = ::mmap(nullptr, m_length, PROT_READ, MAP_PRIVATE, fd, 0);
+		}
+		::close(fd);
 
-		X->set_right(c);
-		X->set_left(Y);
-		X->update_depth();
+		if (m_map == MAP_FAILED) {
+			throw std::runtime_error("MappedAVLFile: cannot map " + path);
+		}
 
-		return X;
+		const AVLFileHeader *header = static_cast<const AVLFileHeader *>(m_map);
+		if (std::memcmp(header->magic, avl_file_magic, sizeof(avl_file_magic)) != 0 ||
+		    header->version != avl_file_version ||
+		    header->element_size != sizeof(T) ||
+		    header->count > (m_length - sizeof(AVLFileHeader)) / sizeof(T)) {
+			::munmap(m_map, m_length);
+			throw std::runtime_error("MappedAVLFile: bad file " + path);
+		}
+	}
+
+	MappedAVLFile(const MappedAVLFile &) = delete;
+	MappedAVLFile &operator=(const MappedAVLFile &) = delete;
+
+	~MappedAVLFile()
+	{
+		::munmap(m_map, m_length);
 	}
 
 	/**
-	 * Right rotation
-	 *
-	 * The node has a -2 sub-tree depth difference and
-	 * the left son a -1 difference.
-	 *
-	 *      from:    Y      to:   X
-	 *              / \          / \
-	 *             X   c        a   Y
-	 *            / \           a  / \
-	 *           a   b            b   c
-	 *           a
+	 * Tell the kernel how the elements will be accessed, with
+	 * MADV_SEQUENTIAL, MADV_RANDOM or MADV_WILLNEED for instance.
 	 */
-	Node<T> *rotate_right(Node<T> *node) const
+	void advise(int advice) const
 	{
-		Node<T> *Y = node;
-		Node<T> *X = Y->get_left();
-		Node<T> *a = X->get_left();
-		Node<T> *b = X->get_right();
-		Node<T> *c = Y->get_right();
+		::madvise(m_map, m_length, advice);
+	}
 
-		Y->set_left(b);
-		Y->set_right(c);
-		Y->update_depth();
+	const T *begin() const
+	{
+		return reinterpret_cast<const T *>(static_cast<const char *>(m_map) + sizeof(AVLFileHeader));
+	}
 
-		X->set_right(a);
-		X->set_right(Y);
-		X->update_depth();
+	const T *end() const
+	{
+		return begin() + size();
+	}
 
-		return X;
+	std::size_t size() const
+	{
+		return static_cast<const AVLFileHeader *>(m_map)->count;
 	}
 
 	/**
-	 * Right left double rotation
-	 *
-	 * The node has a 2 sub-tree depth difference and
-	 * the right son a -1 difference.
-	 *
-	 *      from:    Z      to:    X
-	 *              / \          /   \
-	 *             a   Y        Z     Y
-	 *                / \      / \   / \
-	 *               X   d    a   b c   d
-	 *              / \           b
-	 *             b   c
-	 *             b
+	 * Return a pointer on an element equivalent to key, or nullptr if
+	 * there is none.
 	 */
-	Node<T> *rotate_right_left(Node<T> *node) const
+	template<class K>
+	const T *find(const K &key) const
 	{
-		Node<T> *Z = node;
-		Node<T> *Y = Z->get_right();
-		Node<T> *X = Y->get_left();
-		Node<T> *a = Z->get_left();
-		Node<T> *b = X->get_left();
-		Node<T> *c = X->get_right();
-		Node<T> *d = Y->get_right();
-
-		Z->set_left(a);
-		Z->set_right(b);
-		Z->update_depth();
-
-		Y->set_left(c);
-		Y->set_right(d);
-		Y->update_depth();
+		const T *bound = lower_bound(key);
+		return (bound && !(key < *bound)) ? bound : nullptr;
+	}
 
-		X->set_left(Z);
-		X->set_right(Y);
-		X->update_depth();
+	template<class K>
+	bool contains(const K &key) const
+	{
+		return find(key) != nullptr;
+	}
 
-		return X;
+	/**
+	 * Return a pointer on the first element not less than key, or
+	 * nullptr if there is none.
+	 */
+	template<class K>
+	const T *lower_bound(const K &key) const
+	{
+		const T *bound = std::lower_bound(begin(), end(), key);
+		return bound != end() ? bound : nullptr;
 	}
 
 	/**
+	 * Return a pointer on the first element greater than key, or
+	 * nullptr if there is none.
+	 */
+	template<class K>
+	const T *upper_bound(const K &key) const
+	{
+		const T *bound = std::upper_bound(begin(), end(), key);
+		return bound != end() ? bound : nullptr;
+	}
+
+private:
+	void *m_map;
+	std::size_t m_length;
+};
+
+
+/**
+ * Frozen AVL Tree class.
+ *
+ * Immutable and read-optimized copy of a tree (see AVLTree::freeze).
+ * The elements are stored in an implicit array in Eytzinger (BFS)
+ * order: the children of element k are at 2k and 2k + 1, the root
+ * being at 1. A search needs no pointer and the next comparison index
+ * is computed without a branch, so that the descent never suffers a
+ * branch misprediction. The array is cache line aligned and the
+ * elements a few levels below the current one are prefetched, which
+ * overlaps the memory accesses of consecutive levels.
+ */
+template<class T>
+class FrozenAVLTree
+{
+public:
+	/**
+	 * Build from the sorted range [first, last).
+	 */
+	template<class ForwardIt>
+	FrozenAVLTree(ForwardIt first, ForwardIt last) :
+		FrozenAVLTree(std::distance(first, last), [first, last](auto f) {
+			for (ForwardIt it = first; it != last; ++it) {
+				f(*it);
+			}
+		})
+	{}
+
+	/**
+	 * Build from count elements given in order by visit(f), which must
+	 * call f on each of them.
+	 */
+	template<class Visit>
+	FrozenAVLTree(std::size_t count, Visit visit) :
+		m_layout(nullptr),
+		m_count(count)
+	{
+		void *layout = nullptr;
+		if (::posix_memalign(&layout, cache_line, (m_count + 1) * sizeof(T)) != 0) {
+			throw std::bad_alloc();
+		}
+		m_layout = static_cast<T *>(layout);
+
+		if (m_count == 0) return;
+
+		// The elements arrive in order: the array is filled following
+		// an in-order walk of the implicit tree, starting at its
+		// leftmost element.
+		std::size_t k = 1;
+		while (2 * k <= m_count) {
+			k = 2 * k;
+		}
+
+		visit([this, &k](const T &data) {
+			new (m_layout + k) T(data);
+
+			if (2 * k + 1 <= m_count) {
+				k = 2 * k + 1;
+				while (2 * k <= m_count) {
+					k = 2 * k;
+				}
+			}
+			else {
+				while (k & 1) {
+					k >>= 1;
+				}
+				k >>= 1;
+			}
+		});
+	}
+
+	FrozenAVLTree(FrozenAVLTree &&tree) :
+		m_layout(tree.m_layout),
+		m_count(tree.m_count)
+	{
+		tree.m_layout = nullptr;
+		tree.m_count = 0;
+	}
+
+	FrozenAVLTree(const FrozenAVLTree &) = delete;
+	FrozenAVLTree &operator=(const FrozenAVLTree &) = delete;
+
+	~FrozenAVLTree()
+	{
+		for (std::size_t k = 1; k <= m_count; k++) {
+			m_layout[k].~T();
+		}
+		std::free(m_layout);
+	}
+
+	/**
+	 * Return a pointer on the first element not less than key, or
+	 * nullptr if there is none.
+	 */
+	template<class K>
+	const T *lower_bound(const K &key) const
+	{
+		std::size_t k = 1;
+
+		while (k <= m_count) {
+			prefetch(k);
+			k = 2 * k + (m_layout[k] < key);
+		}
+
+		return bound(k);
+	}
+
+	/**
+	 * Return a pointer on the first element greater than key, or
+	 * nullptr if there is none.
+	 */
+	template<class K>
+	const T *upper_bound(const K &key) const
+	{
+		std::size_t k = 1;
+
+		while (k <= m_count) {
+			prefetch(k);
+			k = 2 * k + !(key < m_layout[k]);
+		}
+
+		return bound(k);
+	}
+
+	/**
+	 * Return a pointer on an element equivalent to key, or nullptr if
+	 * there is none.
+	 */
+	template<class K>
+	const T *find(const K &key) const
+	{
+		const T *lower = lower_bound(key);
+		return (lower && !(key < *lower)) ? lower : nullptr;
+	}
+
+	template<class K>
+	bool contains(const K &key) const
+	{
+		return find(key) != nullptr;
+	}
+
+	/**
+	 * Return the number of elements.
+	 */
+	std::size_t size() const
+	{
+		return m_count;
+	}
+
+private:
+	static constexpr std::size_t cache_line = 64;
+
+	static constexpr std::size_t log2_floor(std::size_t n)
+	{
+		std::size_t levels = 0;
+		while (n >>= 1) {
+			levels++;
+		}
+		return levels;
+	}
+
+	/**
+	 * Distance, in levels, of the prefetched descendants. The 2^levels
+	 * descendants of k at that depth are contiguous from k << levels
+	 * and, with at most cache_line / sizeof(T) of them, share a cache
+	 * line.
+	 */
+	static constexpr std::size_t prefetch_levels =
+		sizeof(T) >= cache_line ? 1 : log2_floor(cache_line / sizeof(T));
+
+	void prefetch(std::size_t k) const
+	{
+		__builtin_prefetch(m_layout + std::min(k << prefetch_levels, m_count));
+	}
+
+	/**
+	 * The search ends at an index beyond the array. The last element
+	 * for which the descent went left is found by dropping the trailing
+	 * right moves (1 bits) and the last left move (a 0 bit). Index 0
+	 * means that the descent never went left.
+	 */
+	const T *bound(std::size_t k) const
+	{
+		k >>= __builtin_ctzll(~k) + 1;
+		return k ? m_layout + k : nullptr;
+	}
+
+private:
+	T *m_layout;
+	std::size_t m_count;
+};
+
+
+
+/**
+ * AVL Tree class.
+ *
+ * It points to a Node root. Nodes are obtained from the Alloc policy
+ * (NodePool by default, see HeapAllocator for the interface). When
+ * Ranked is true, each node also stores the size of its sub-tree,
+ * which gives select() and rank() in O(log n).
+ *
+ * When Multi is true (multiset mode), equivalent elements share a
+ * single node holding their count: pushing an element already in the
+ * tree increments the count and removing it decrements the count. The
+ * tree only grows with distinct keys.
+ */
+template<class T, template<class> class Alloc = NodePool, bool Ranked = false, bool Multi = false>
+class AVLTree
+{
+public:
+	typedef Node<T, Ranked, Multi> node_type;
+
+	/**
+	 * Node handle: owns a node extracted from a tree (see extract()),
+	 * until it is inserted in a tree (see insert()) or destroyed. The
+	 * element can be modified in between, to give it a new key for
+	 * instance. With a NodePool, the handle must not outlive the tree
+	 * it comes from, since the pool owns the node memory.
+	 */
+	class node_handle
+	{
+	public:
+		node_handle() : m_node(nullptr), m_alloc(nullptr) {}
+
+		node_handle(node_handle &&handle) :
+			m_node(handle.m_node),
+			m_alloc(handle.m_alloc)
+		{
+			handle.m_node = nullptr;
+		}
+
+		node_handle &operator=(node_handle &&handle)
+		{
+			std::swap(m_node, handle.m_node);
+			std::swap(m_alloc, handle.m_alloc);
+			return *this;
+		}
+
+		~node_handle()
+		{
+			if (m_node) {
+				m_alloc->destroy(m_node);
+			}
+		}
+
+		explicit operator bool() const {return m_node != nullptr;}
+
+		/**
+		 * Return the owned element.
+		 */
+		T &value() const {return m_node->get_data();}
+
+	private:
+		friend class AVLTree;
+
+		node_handle(node_type *node, Alloc<node_type> *alloc) :
+			m_node(node),
+			m_alloc(alloc)
+		{}
+
+		node_type *m_node;
+		Alloc<node_type> *m_alloc;
+	};
+
+	/**
+	 * AVLTree constructor
+	 */
+	AVLTree() :	m_head (nullptr), m_count(0) {}
+
+	/**
+	 * Build a tree from the elements of the range [first, last).
 	 *
-	 * Left right double rotation
-	 *
-	 * The node has a -2 subtree depth difference and
-	 * the left son a 1 difference.
-	 *
-	 *     from:    Z      to:    X
-	 *             / \          /   \
-	 *            Y   d        Y     Z
-	 *           / \          / \   / \
-	 *          a   X        a   b c   d
-	 *             / \             c
-	 *            b   c
-	 *                c
+	 * @sa assign
+	 */
+	template<class ForwardIt>
+	AVLTree(ForwardIt first, ForwardIt last, bool sorted=true) :
+		m_head(nullptr),
+		m_count(0)
+	{
+		assign(first, last, sorted);
+	}
+
+	AVLTree(const AVLTree &) = delete;
+	AVLTree &operator=(const AVLTree &) = delete;
+
+	/**
+	 * AVLTree destructor. Free all nodes.
+	 */
+	~AVLTree()
+	{
+		clear();
+	}
+
+	/**
+	 * Remove all elements. When the allocator supports it, the nodes
+	 * are dropped in bulk without walking the tree.
+	 */
+	void clear()
+	{
+		if (!Alloc<node_type>::bulk_release) {
+			delete_recurse(m_head);
+		}
+
+		m_alloc.release();
+		m_head = nullptr;
+		m_count = 0;
+	}
+
+	/**
+	 * Return the number of elements stored in the tree, equivalent
+	 * elements included.
+	 */
+	std::size_t size() const
+	{
+		return m_count;
+	}
+
+	/**
+	 * Return the depth of the tree, 0 when it is empty.
+	 */
+	std::size_t depth() const
+	{
+		return depth(m_head);
+	}
+
+	/**
+	 * Print to the dot format the tree. Payload T must implements the
+	 * operator<< overloading.
+	 */
+	void to_dot(const std::string &graph_name="to_dot") const
+	{
+		if(m_head) {
+			m_head->to_dot(std::cout, graph_name);
+		}
+	}
+
+	/**
+	 * Replace the content of the tree with the elements of the range
+	 * [first, last).
+	 *
+	 * When the range is sorted, the tree is built bottom-up in a
+	 * single O(n) pass: the middle element becomes the root and each
+	 * half is built recursively, so no rotation is ever needed and
+	 * every depth is exact. When sorted is false, the range is first
+	 * copied and sorted. In multiset mode, each run of equivalent
+	 * elements becomes a single node.
+	 */
+	template<class ForwardIt>
+	AVLTree &assign(ForwardIt first, ForwardIt last, bool sorted=true)
+	{
+		clear();
+
+		if (sorted) {
+			m_head = build_recurse(first, last, count_runs(first, last));
+		}
+		else {
+			std::vector<T> values(first, last);
+			std::sort(values.begin(), values.end());
+			auto it = std::make_move_iterator(values.begin());
+			auto end = std::make_move_iterator(values.end());
+			m_head = build_recurse(it, end, count_runs(it, end));
+		}
+
+		return *this;
+	}
+
+	/**
+	 * Insert an element in the tree. Keep the node sorted. The
+	 * insertion can execute one rotation after insertion to keep the
+	 * tree properly balanced.
+	 */
+	AVLTree &push(const T &value)
+	{
+		if (Multi && adjust_count(value, 1)) {
+			return *this;
+		}
+		return link(create_node(value), false);
+	}
+
+	/**
+	 * Insert an element in the tree, moving it in the new node.
+	 */
+	AVLTree &push(T &&value)
+	{
+		if (Multi && adjust_count(value, 1)) {
+			return *this;
+		}
+		return link(create_node(std::move(value)), false);
+	}
+
+	/**
+	 * Insert an element built in place in the new node from args.
+	 */
+	template<class... Args>
+	AVLTree &emplace(Args&&... args)
+	{
+		return link(create_node(typename node_type::in_place_t(), std::forward<Args>(args)...), true);
+	}
+
+	/**
+	 * Insert all elements of the range [first, last), as if each of
+	 * them was pushed.
+	 *
+	 * The batch is sorted (unless sorted is true), built into a
+	 * balanced tree in O(k) and merged like unite: the tree is split
+	 * around each node of the batch, so every node of the tree is
+	 * visited and rebalanced at most once per batch instead of once
+	 * per element, and independent sub-trees are merged in parallel.
+	 */
+	template<class ForwardIt>
+	AVLTree &push_batch(ForwardIt first, ForwardIt last, bool sorted=false)
+	{
+		node_type *batch;
+
+		if (sorted) {
+			batch = build_recurse(first, last, count_runs(first, last));
+		}
+		else {
+			std::vector<T> values(first, last);
+			std::sort(values.begin(), values.end());
+			auto it = std::make_move_iterator(values.begin());
+			auto end = std::make_move_iterator(values.end());
+			batch = build_recurse(it, end, count_runs(it, end));
+		}
+
+		return set_operation(SetOperation::unite, batch);
+	}
+
+	/**
+	 * Remove an element in the tree. It can execute a rotation during
+	 * the ascent of each parent until the root after the node deletion.
+	 */
+	AVLTree &remove(const T &value)
+	{
+		if (Multi && adjust_count(value, -1)) {
+			return *this;
+		}
+
+		node_type *unlinked = nullptr;
+		m_head = unlink_recurse(m_head, value, unlinked);
+		if (unlinked) {
+			destroy_node(unlinked);
+		}
+		return *this;
+	}
+
+	/**
+	 * Unlink an element equivalent to key from the tree and return it
+	 * in a node handle, without any copy or deallocation. The handle is
+	 * empty if there is no such element. In multiset mode, the node
+	 * holds all the equivalent elements.
+	 */
+	template<class K>
+	node_handle extract(const K &key)
+	{
+		node_type *unlinked = nullptr;
+		m_head = unlink_recurse(m_head, key, unlinked);
+		if (!unlinked) {
+			return node_handle();
+		}
+
+		m_count -= unlinked->get_count();
+		unlinked->set_left(nullptr);
+		unlinked->set_right(nullptr);
+		unlinked->update_depth();
+		return node_handle(unlinked, &m_alloc);
+	}
+
+	/**
+	 * Insert the element owned by a node handle, which is left empty.
+	 * If both trees have equal allocators, the node itself is linked
+	 * with no allocation. Otherwise the element is moved in a node of
+	 * this tree. In multiset mode, the count of the handle is added to
+	 * the node of an equivalent element if there is one.
+	 */
+	AVLTree &insert(node_handle &&handle)
+	{
+		if (!handle) {
+			return *this;
+		}
+
+		node_type *node = handle.m_node;
+		std::size_t count = node->get_count();
+
+		if (Multi && adjust_count(node->get_data(), count)) {
+			handle.m_node = nullptr;
+			handle.m_alloc->destroy(node);
+			return *this;
+		}
+
+		if (*handle.m_alloc == m_alloc) {
+			handle.m_node = nullptr;
+			m_count += count;
+			return link(node, false);
+		}
+
+		// The handle keeps the node until the copy exists, so that a
+		// failed allocation loses nothing.
+		node_type *copy = create_node(std::move(node->get_data()));
+		handle.m_node = nullptr;
+		copy->set_count(count);
+		copy->update_depth();
+		m_count += count - 1;
+		handle.m_alloc->destroy(node);
+		return link(copy, false);
+	}
+
+	/**
+	 * Return a pointer on an element equivalent to key, or nullptr if
+	 * there is none.
+	 *
+	 * All the lookup functions descend iteratively from the root. The
+	 * key can be of any type K comparable with T using operator< in
+	 * both directions, so that no temporary T is built for a lookup.
+	 */
+	template<class K>
+	const T *find(const K &key) const
+	{
+		const node_type *node = m_head;
+
+		while (node) {
+			const T &data = node->get_data();
+			if (key < data) {
+				node = node->get_left();
+			}
+			else if (data < key) {
+				node = node->get_right();
+			}
+			else {
+				return &data;
+			}
+		}
+
+		return nullptr;
+	}
+
+	/**
+	 * Return true if an element equivalent to key is in the tree.
+	 */
+	template<class K>
+	bool contains(const K &key) const
+	{
+		return find(key) != nullptr;
+	}
+
+	/**
+	 * Return a pointer on the first element that is not less than
+	 * key, or nullptr if there is none.
+	 */
+	template<class K>
+	const T *lower_bound(const K &key) const
+	{
+		const node_type *node = m_head;
+		const T *bound = nullptr;
+
+		while (node) {
+			const T &data = node->get_data();
+			if (data < key) {
+				node = node->get_right();
+			}
+			else {
+				bound = &data;
+				node = node->get_left();
+			}
+		}
+
+		return bound;
+	}
+
+	/**
+	 * Return a pointer on the first element that is greater than key,
+	 * or nullptr if there is none.
+	 */
+	template<class K>
+	const T *upper_bound(const K &key) const
+	{
+		const node_type *node = m_head;
+		const T *bound = nullptr;
+
+		while (node) {
+			const T &data = node->get_data();
+			if (key < data) {
+				bound = &data;
+				node = node->get_left();
+			}
+			else {
+				node = node->get_right();
+			}
+		}
+
+		return bound;
+	}
+
+	/**
+	 * Call f on each element, in order.
+	 */
+	template<class F>
+	void visit(F f) const
+	{
+		visit_recurse(m_head, f);
+	}
+
+	/**
+	 * Call f on each element in [lo, hi], in order. Sub-trees lying
+	 * outside the bounds are skipped, so the cost is O(log n + k) for k
+	 * visited elements.
+	 */
+	template<class K1, class K2, class F>
+	void visit_range(const K1 &lo, const K2 &hi, F f) const
+	{
+		visit_range_recurse(m_head, lo, hi, f);
+	}
+
+	/**
+	 * Remove all elements in [lo, hi] and return how many were
+	 * removed. The tree is split around the range, the range is freed
+	 * and both remaining parts are joined back: O(log n) restructuring
+	 * plus the k node frees.
+	 */
+	template<class K1, class K2>
+	std::size_t remove_range(const K1 &lo, const K2 &hi)
+	{
+		node_type *lower, *middle, *upper;
+
+		split(m_head, [&lo](const T &data) {return data < lo;}, lower, middle);
+		split(middle, [&hi](const T &data) {return !(hi < data);}, middle, upper);
+
+		std::size_t count = m_count;
+		delete_recurse(middle);
+		m_head = join2(lower, upper);
+
+		return count - m_count;
+	}
+
+	/**
+	 * Append the elements of other, which must all be not less than
+	 * the elements of this tree (greater in multiset mode). other is
+	 * left empty. The two trees are joined in O(log n).
+	 */
+	AVLTree &concat(AVLTree &&other)
+	{
+		m_head = join2(m_head, adopt(other));
+		return *this;
+	}
+
+	/**
+	 * Move all elements of other into this tree, as if each of them
+	 * was pushed: equivalent elements of both trees are all kept (their
+	 * counts are added in multiset mode). other is left empty.
+	 *
+	 * The set operations are join based: the tree is split around the
+	 * root of other, then both halves are processed independently and
+	 * joined back. The two halves are forked onto separate threads
+	 * while they are large enough.
+	 */
+	AVLTree &unite(AVLTree &&other)
+	{
+		return set_operation(SetOperation::unite, adopt(other));
+	}
+
+	/**
+	 * Keep only the elements that have an equivalent in other. other
+	 * is left empty.
+	 *
+	 * @sa unite
+	 */
+	AVLTree &intersect(AVLTree &&other)
+	{
+		return set_operation(SetOperation::intersect, adopt(other));
+	}
+
+	/**
+	 * Remove the elements that have an equivalent in other. other is
+	 * left empty.
+	 *
+	 * @sa unite
+	 */
+	AVLTree &subtract(AVLTree &&other)
+	{
+		return set_operation(SetOperation::subtract, adopt(other));
+	}
+
+	/**
+	 * Return an immutable copy of the tree, laid out for fast
+	 * lookups. The tree can keep changing afterwards.
+	 *
+	 * @sa FrozenAVLTree
+	 */
+	FrozenAVLTree<T> freeze() const
+	{
+		return FrozenAVLTree<T>(m_count, [this](auto f) {visit(f);});
+	}
+
+	/**
+	 * Write the elements in a binary file (see AVLFileHeader), in
+	 * order. The file can be queried in place with MappedAVLFile or
+	 * loaded back with load(). Throw std::runtime_error on failure.
+	 */
+	void save(const std::string &path) const
+	{
+		static_assert(std::is_trivially_copyable<T>::value,
+		              "only trivially copyable elements can be saved");
+
+		std::FILE *file = std::fopen(path.c_str(), "wb");
+		if (!file) {
+			throw std::runtime_error("AVLTree: cannot create " + path);
+		}
+
+		AVLFileHeader header = {};
+		std::memcpy(header.magic, avl_file_magic, sizeof(avl_file_magic));
+		header.version = avl_file_version;
+		header.element_size = sizeof(T);
+		header.count = m_count;
+		bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+
+		// The elements are gathered in a buffer to issue large writes.
+		std::vector<T> buffer;
+		buffer.reserve(std::max<std::size_t>(1, (1 << 20) / sizeof(T)));
+		auto flush = [&] {
+			ok = ok && std::fwrite(buffer.data(), sizeof(T), buffer.size(), file) == buffer.size();
+			buffer.clear();
+		};
+
+		visit([&](const T &data) {
+			buffer.push_back(data);
+			if (buffer.size() == buffer.capacity()) {
+				flush();
+			}
+		});
+		flush();
+
+		ok = (std::fclose(file) == 0) && ok;
+		if (!ok) {
+			throw std::runtime_error("AVLTree: cannot write " + path);
+		}
+	}
+
+	/**
+	 * Replace the content of the tree with the elements of a file
+	 * written by save(). The file is mapped and the tree is built in a
+	 * single O(n) pass, without any rotation.
+	 */
+	AVLTree &load(const std::string &path)
+	{
+		MappedAVLFile<T> file(path);
+		file.advise(MADV_SEQUENTIAL);
+		return assign(file.begin(), file.end());
+	}
+
+	/**
+	 * Return a pointer on the k-th smallest element (starting from 0),
+	 * or nullptr if k is out of range. Only available on Ranked trees.
+	 */
+	const T *select(std::size_t k) const
+	{
+		static_assert(Ranked, "select() needs a Ranked AVLTree");
+
+		const node_type *node = m_head;
+
+		while (node) {
+			std::size_t left = sub_tree_size(node->get_left());
+			if (k < left) {
+				node = node->get_left();
+			}
+			else if (k < left + node->get_count()) {
+				return &node->get_data();
+			}
+			else {
+				k -= left + node->get_count();
+				node = node->get_right();
+			}
+		}
+
+		return nullptr;
+	}
+
+	/**
+	 * Return the number of elements less than key. Only available on
+	 * Ranked trees.
+	 */
+	template<class K>
+	std::size_t rank(const K &key) const
+	{
+		static_assert(Ranked, "rank() needs a Ranked AVLTree");
+
+		const node_type *node = m_head;
+		std::size_t count = 0;
+
+		while (node) {
+			if (node->get_data() < key) {
+				count += sub_tree_size(node->get_left()) + node->get_count();
+				node = node->get_right();
+			}
+			else {
+				node = node->get_left();
+			}
+		}
+
+		return count;
+	}
+
+	/**
+	 * Check if the tree violates the AVL property. Return the number
+	 * of errors found.
+	 */
+	std::size_t check() const {
+		return check_recurse(m_head);
+	}
+
+
+private:
+
+	/**
+	 * Allocate a node. All node creations go through here to keep the
+	 * element count up to date.
+	 */
+	template<class... Args>
+	node_type *create_node(Args&&... args)
+	{
+		node_type *node = m_alloc.create(std::forward<Args>(args)...);
+		m_count++;
+		return node;
+	}
+
+	/**
+	 * Free a node. All node destructions go through here to keep the
+	 * element count up to date.
+	 */
+	void destroy_node(node_type *node)
+	{
+		m_count -= node->get_count();
+		m_alloc.destroy(node);
+	}
+
+	/**
+	 * Largest possible depth of an AVL tree (about 1.44 log2(n)).
+	 */
+	static constexpr std::size_t max_depth = 96;
+
+	/**
+	 * Multiset mode: change by delta the count of the node holding an
+	 * element equivalent to key, if there is one and its count stays
+	 * positive. The sub-tree sizes along the path are updated. Return
+	 * true if the count was changed.
+	 */
+	template<class K>
+	bool adjust_count(const K &key, std::ptrdiff_t delta)
+	{
+		node_type *path[max_depth];
+		std::size_t length = 0;
+		node_type *node = m_head;
+
+		while (node) {
+			path[length++] = node;
+			if (key < node->get_data()) {
+				node = node->get_left();
+			}
+			else if (node->get_data() < key) {
+				node = node->get_right();
+			}
+			else {
+				break;
+			}
+		}
+
+		if (!node || std::ptrdiff_t(node->get_count()) + delta <= 0) {
+			return false;
+		}
+
+		node->set_count(node->get_count() + delta);
+		m_count += delta;
+
+		if (Ranked) {
+			while (length) {
+				path[--length]->update_depth();
+			}
+		}
+
+		return true;
+	}
+
+	static std::size_t sub_tree_size(const node_type *node)
+	{
+		return node ? node->get_size() : 0;
+	}
+
+	/**
+	 * Free the sub-nodes recursively and the given node.
+	 */
+	void delete_recurse(node_type *node)
+	{
+		if (node) {
+			delete_recurse(node->get_left());
+			delete_recurse(node->get_right());
+			destroy_node(node);
+		}
+	}
+
+	/**
+	 * Return the number of nodes needed by the sorted range: its
+	 * number of elements, or of distinct elements in multiset mode.
+	 */
+	template<class ForwardIt>
+	static std::size_t count_runs(ForwardIt first, ForwardIt last)
+	{
+		if (!Multi) {
+			return std::distance(first, last);
+		}
+
+		std::size_t runs = 0;
+		for (ForwardIt previous = first; first != last; previous = first) {
+			runs++;
+			while (++first != last && !(*previous < *first)) {}
+		}
+		return runs;
+	}
+
+	/**
+	 * Build a perfectly balanced tree of count nodes from the sorted
+	 * elements starting at it. The elements are consumed in order, so
+	 * the iterator only needs to be a forward iterator.
+	 */
+	template<class ForwardIt>
+	node_type *build_recurse(ForwardIt &it, ForwardIt last, std::size_t count)
+	{
+		if (count == 0) return nullptr;
+
+		std::size_t left_count = count / 2;
+		node_type *left = build_recurse(it, last, left_count);
+
+		node_type *node = create_node(*it, nullptr);
+		++it;
+
+		if (Multi) {
+			std::size_t run = 1;
+			for (; it != last && !(node->get_data() < *it); ++it) {
+				run++;
+			}
+			node->set_count(run);
+			m_count += run - 1;
+		}
+
+		node->set_left(left);
+		node->set_right(build_recurse(it, last, count - left_count - 1));
+		node->update_depth();
+
+		return node;
+	}
+
+	/**
+	 * Left rotation
+	 *
+	 * The node has a 2 sub-tree depth difference and
+	 * the right son a 1 difference.
+	 *
+	 *      from:   Y         to:    X
+	 *             / \              / \
+	 *            a   X            Y   c
+	 *               / \          / \  c
+	 *              b   c        a   b
+	 *                  c
+	 */
+	node_type *rotate_left(node_type *node) const
+	{
+		node_type *Y = node;
+		node_type *X = Y->get_right();
+		node_type *a = Y->get_left();
+		node_type *b = X->get_left();
+		node_type *c = X->get_right();
+
+		Y->set_left(a);
+		Y->set_right(b);
+		Y->update_depth();
+
+		X->set_right(c);
+		X->set_left(Y);
+		X->update_depth();
+
+		return X;
+	}
+
+	/**
+	 * Right rotation
+	 *
+	 * The node has a -2 sub-tree depth difference and
+	 * the left son a -1 difference.
+	 *
+	 *      from:    Y      to:   X
+	 *              / \          / \
+	 *             X   c        a   Y
+	 *            / \           a  / \
+	 *           a   b            b   c
+	 *           a
+	 */
+	node_type *rotate_right(node_type *node) const
+	{
+		node_type *Y = node;
+		node_type *X = Y->get_left();
+		node_type *a = X->get_left();
+		node_type *b = X->get_right();
+		node_type *c = Y->get_right();
+
+		Y->set_left(b);
+		Y->set_right(c);
+		Y->update_depth();
+
+		X->set_right(a);
+		X->set_right(Y);
+		X->update_depth();
+
+		return X;
+	}
+
+	/**
+	 * Right left double rotation
+	 *
+	 * The node has a 2 sub-tree depth difference and
+	 * the right son a -1 difference.
+	 *
+	 *      from:    Z      to:    X
+	 *              / \          /   \
+	 *             a   Y        Z     Y
+	 *                / \      / \   / \
+	 *               X   d    a   b c   d
+	 *              / \           b
+	 *             b   c
+	 *             b
+	 */
+	node_type *rotate_right_left(node_type *node) const
+	{
+		node_type *Z = node;
+		node_type *Y = Z->get_right();
+		node_type *X = Y->get_left();
+		node_type *a = Z->get_left();
+		node_type *b = X->get_left();
+		node_type *c = X->get_right();
+		node_type *d = Y->get_right();
+
+		Z->set_left(a);
+		Z->set_right(b);
+		Z->update_depth();
+
+		Y->set_left(c);
+		Y->set_right(d);
+		Y->update_depth();
+
+		X->set_left(Z);
+		X->set_right(Y);
+		X->update_depth();
+
+		return X;
+	}
+
+	/**
+	 *
+	 * Left right double rotation
+	 *
+	 * The node has a -2 subtree depth difference and
+	 * the left son a 1 difference.
+	 *
+	 *     from:    Z      to:    X
+	 *             / \          /   \
+	 *            Y   d        Y     Z
+	 *           / \          / \   / \
+	 *          a   X        a   b c   d
+	 *             / \             c
+	 *            b   c
+	 *                c
+	 */
+	node_type *rotate_left_right(node_type *node) const
+	{
+		node_type *Z = node;
+		node_type *Y = Z->get_left();
+		node_type *X = Y->get_right();
+		node_type *a = Y->get_left();
+		node_type *b = X->get_left();
+		node_type *c = X->get_right();
+		node_type *d = Z->get_right();
+
+		Y->set_left(a);
+		Y->set_right(b);
+		Y->update_depth();
+
+		Z->set_left(c);
+		Z->set_right(d);
+		Z->update_depth();
+
+		X->set_left(Y);
+		X->set_right(Z);
+		X->update_depth();
+
+		return X;
+	}
+
+	/**
+	 * Balance the tree. Call the right rotation depending on the
+	 * sub-nodes depth.
+	 */
+	node_type *balance_tree(node_type *node) const {
+		if (!node) return nullptr;
+
+		int64_t diff = node->get_depth_diff();
+		if (diff < -1) {
+			node_type *left = node->get_left();
+			if (left) {
+				int64_t diff_left = left->get_depth_diff();
+				if(diff_left <= 0) {
+					return rotate_right(node);
+				}
+				else {
+					return rotate_left_right(node);
+				}
+			}
+		}
+		else if (diff > 1) {
+			node_type *right = node->get_right();
+			if (right) {
+				int64_t diff_right = right->get_depth_diff();
+				if(diff_right >= 0) {
+					return rotate_left(node);
+				}
+				else {
+					return rotate_right_left(node);
+				}
+			}
+		}
+
+		assert(std::abs(node->get_depth_diff())<=1);
+
+		return node;
+	}
+
+	/**
+	 * Link a new leaf in the tree. In multiset mode, merge tells to
+	 * look for an equivalent element first and add the leaf count to
+	 * it; callers that already did this lookup pass false.
+	 */
+	AVLTree &link(node_type *leaf, bool merge)
+	{
+		if (Multi && merge && adjust_count(leaf->get_data(), leaf->get_count())) {
+			destroy_node(leaf);
+			return *this;
+		}
+
+		m_head = push_recurse(m_head, leaf);
+		return *this;
+	}
+
+	/**
+	 * Push the leaf by recursively searching for the right place in
+	 * the node. After insertion, apply the proper rotation depending
+	 * on tree depth.
+	 *
+	 * There is four balance cases:
+	 *
+	 * - left rotation: the node has a 2 sub-tree depth difference and
+	 *   the right son a 1 difference.
+	 *
+	 * - right rotation: The node has a -2 sub-tree depth difference
+	 *   and the left son a -1 difference.
+	 *
+	 * - double right left rotation: The node has a 2 sub-tree depth
+	 *   difference and the right son a -1 difference.
+	 *
+	 * - double left right rotation: The node has a -2 subtree depth
+	 *   difference and the left son a -1 difference.
+	 *
+	 */
+	node_type *push_recurse(node_type *node, node_type *leaf) const
+	{
+		if (node == nullptr) {
+			return leaf;
+		}
+
+		if(leaf->get_data() < node->get_data()) {
+			node->set_left(push_recurse(node->get_left(), leaf));
+		}
+		else {
+			node->set_right(push_recurse(node->get_right(), leaf));
+		}
+
+		node->update_depth();
+
+		return balance_tree(node);
+	}
+
+	enum class SetOperation {unite, intersect, subtract};
+
+	/**
+	 * Minimum depth of both sub-trees for a set operation to fork
+	 * (about a thousand elements each).
+	 */
+	static constexpr std::size_t parallel_min_depth = 10;
+
+	/**
+	 * Take the nodes of other, leaving it empty, and return its root.
+	 */
+	node_type *adopt(AVLTree &other)
+	{
+		assert(&other != this);
+
+		node_type *head = other.m_head;
+		m_alloc.adopt(other.m_alloc);
+		m_count += other.m_count;
+		other.m_head = nullptr;
+		other.m_count = 0;
+
+		return head;
+	}
+
+	/**
+	 * Apply the set operation between this tree and the tree of root
+	 * head, whose nodes already belong to this tree's allocator.
+	 */
+	AVLTree &set_operation(SetOperation op, node_type *head)
+	{
+		// The operation may run on several threads, so the nodes to
+		// free are collected and only given back to the allocator
+		// once all threads are done.
+		std::vector<node_type *> garbage;
+
+		unsigned threads = std::thread::hardware_concurrency();
+		unsigned forks = 0;
+		while ((1u << forks) < threads) {
+			forks++;
+		}
+
+		m_head = set_recurse(op, m_head, head, garbage, forks);
+
+		for (node_type *node: garbage) {
+			delete_recurse(node);
+		}
+
+		return *this;
+	}
+
+	/**
+	 * Apply the set operation to the trees a (this tree) and b (the
+	 * other one). Sub-trees to free are appended to garbage. Up to
+	 * forks levels of the recursion run their two halves in parallel.
+	 */
+	node_type *set_recurse(SetOperation op, node_type *a, node_type *b,
+	                       std::vector<node_type *> &garbage, unsigned forks) const
+	{
+		if (!a || !b) {
+			bool keep_a = op != SetOperation::intersect;
+			bool keep_b = op == SetOperation::unite;
+			node_type *drop = a ? (keep_a ? nullptr : a) : (keep_b ? nullptr : b);
+			if (drop) {
+				garbage.push_back(drop);
+			}
+			return a ? (keep_a ? a : nullptr) : (keep_b ? b : nullptr);
+		}
+
+		// Split a around the key of b: lower < key, equal == key and
+		// upper > key. The union only needs to isolate equal in
+		// multiset mode, to merge it with b.
+		const T &key = b->get_data();
+		node_type *lower, *equal = nullptr, *upper;
+		split(a, [&key](const T &data) {return data < key;}, lower, upper);
+		if (op != SetOperation::unite || Multi) {
+			split(upper, [&key](const T &data) {return !(key < data);}, equal, upper);
+		}
+
+		node_type *b_left = b->get_left();
+		node_type *b_right = b->get_right();
+
+		if (forks && std::min(depth(a), depth(b)) >= parallel_min_depth) {
+			std::vector<node_type *> upper_garbage;
+			auto upper_task = std::async(std::launch::async, [&] {
+				return set_recurse(op, upper, b_right, upper_garbage, forks - 1);
+			});
+			lower = set_recurse(op, lower, b_left, garbage, forks - 1);
+			upper = upper_task.get();
+			garbage.insert(garbage.end(), upper_garbage.begin(), upper_garbage.end());
+		}
+		else {
+			lower = set_recurse(op, lower, b_left, garbage, 0);
+			upper = set_recurse(op, upper, b_right, garbage, 0);
+		}
+
+		if (op == SetOperation::unite) {
+			if (!equal) {
+				return join(lower, b, upper);
+			}
+
+			// Multiset mode: equal is a single node taking the count of
+			// b. b is freed empty, so the element count is unchanged.
+			equal->set_count(equal->get_count() + b->get_count());
+			b->set_count(0);
+			b->set_left(nullptr);
+			b->set_right(nullptr);
+			garbage.push_back(b);
+			return join(lower, equal, upper);
+		}
+
+		b->set_left(nullptr);
+		b->set_right(nullptr);
+		garbage.push_back(b);
+
+		if (op == SetOperation::intersect) {
+			return join2(join2(lower, equal), upper);
+		}
+
+		if (equal) {
+			garbage.push_back(equal);
+		}
+		return join2(lower, upper);
+	}
+
+	static std::size_t depth(const node_type *node)
+	{
+		return node ? node->get_depth() : 0;
+	}
+
+	/**
+	 * Join two trees and a middle node. All elements of left must not
+	 * be greater than mid, and all elements of right not less than
+	 * mid. If the depths are close, mid simply becomes the new root.
+	 * Otherwise mid is attached along the spine of the deeper tree, at
+	 * the first node of similar depth, and the tree is balanced on the
+	 * way back up like after an insertion. Cost: O(depth difference).
+	 */
+	node_type *join(node_type *left, node_type *mid, node_type *right) const
+	{
+		if (depth(left) > depth(right) + 1) {
+			left->set_right(join(left->get_right(), mid, right));
+			left->update_depth();
+			return balance_tree(left);
+		}
+
+		if (depth(right) > depth(left) + 1) {
+			right->set_left(join(left, mid, right->get_left()));
+			right->update_depth();
+			return balance_tree(right);
+		}
+
+		mid->set_left(left);
+		mid->set_right(right);
+		mid->update_depth();
+		return mid;
+	}
+
+	/**
+	 * Join two trees, all elements of left not being greater than the
+	 * ones of right. The smallest node of right is used as the middle
+	 * node.
+	 */
+	node_type *join2(node_type *left, node_type *right) const
+	{
+		if (!left) return right;
+		if (!right) return left;
+
+		node_type *smallest;
+		right = unlink_smallest(right, smallest);
+		return join(left, smallest, right);
+	}
+
+	/**
+	 * Unlink the smallest node of the sub-tree and store it in
+	 * smallest. Return the new sub-tree root, balanced.
+	 */
+	node_type *unlink_smallest(node_type *node, node_type *&smallest) const
+	{
+		if (!node->get_left()) {
+			smallest = node;
+			return node->get_right();
+		}
+
+		node->set_left(unlink_smallest(node->get_left(), smallest));
+		node->update_depth();
+		return balance_tree(node);
+	}
+
+	/**
+	 * Split the sub-tree in two trees: left gets the elements for which
+	 * goes_left is true, right gets the others. The predicate must be
+	 * true on a prefix of the ordered elements (like data < key). Cost:
+	 * O(log n), each level doing one join.
+	 */
+	template<class Pred>
+	void split(node_type *node, Pred goes_left, node_type *&left, node_type *&right) const
+	{
+		if (!node) {
+			left = right = nullptr;
+			return;
+		}
+
+		node_type *l = node->get_left();
+		node_type *r = node->get_right();
+
+		if (goes_left(node->get_data())) {
+			split(r, goes_left, r, right);
+			left = join(l, node, r);
+		}
+		else {
+			split(l, goes_left, left, l);
+			right = join(l, node, r);
+		}
+	}
+
+	template<class F>
+	static void visit_recurse(const node_type *node, F &f)
+	{
+		if (node) {
+			visit_recurse(node->get_left(), f);
+			for (std::size_t count = node->get_count(); count; count--) {
+				f(node->get_data());
+			}
+			visit_recurse(node->get_right(), f);
+		}
+	}
+
+	template<class K1, class K2, class F>
+	void visit_range_recurse(const node_type *node, const K1 &lo, const K2 &hi, F &f) const
+	{
+		if (!node) return;
+
+		const T &data = node->get_data();
+		bool above_lo = !(data < lo);
+		bool below_hi = !(hi < data);
+
+		if (above_lo) {
+			visit_range_recurse(node->get_left(), lo, hi, f);
+		}
+
+		if (above_lo && below_hi) {
+			for (std::size_t count = node->get_count(); count; count--) {
+				f(data);
+			}
+		}
+
+		if (below_hi) {
+			visit_range_recurse(node->get_right(), lo, hi, f);
+		}
+	}
+
+	/**
+	 * Unlink the largest node of the sub-tree and store it in largest.
+	 * Return the new sub-tree root, balanced during the recursion
+	 * unwinding.
+	 */
+	node_type *unlink_largest(node_type *node, node_type *&largest) const
+	{
+		if (!node->get_right()) {
+			largest = node;
+			return node->get_left();
+		}
+
+		node->set_right(unlink_largest(node->get_right(), largest));
+		node->update_depth();
+		return balance_tree(node);
+	}
+
+	/**
+	 * Unlink the node holding an element equivalent to key and store
+	 * it in unlinked (left untouched if there is none). Apply rotations
+	 * during the ascent of each parent until the root to keep the tree
+	 * properly balanced.
+	 *
+	 * Nodes are relinked, never copied: a node with two sub-nodes is
+	 * replaced by the largest node of its left sub-tree.
+	 */
+	template<class K>
+	node_type *unlink_recurse(node_type *node, const K &key, node_type *&unlinked)
+	{
+		if (!node) return nullptr;
+
+		node_type *left = node->get_left();
+		node_type *right = node->get_right();
+		const T &data = node->get_data();
+
+		if(key < data) {
+			node->set_left(unlink_recurse(left, key, unlinked));
+		}
+		else if(data < key) {
+			node->set_right(unlink_recurse(right, key, unlinked));
+		}
+		else {
+			unlinked = node;
+
+			// With a single sub-node, the sub-node simply takes the place
+			// of the unlinked node: it is already balanced.
+			if (!left) return right;
+			if (!right) return left;
+
+			node_type *largest;
+			left = unlink_largest(left, largest);
+			largest->set_left(left);
+			largest->set_right(right);
+			node = largest;
+		}
+
+		// We must keep the tree balanced during the recursion
+		// unwinding.
+		node->update_depth();
+		return balance_tree(node);
+	}
+
+	std::size_t check_recurse(node_type *node) const {
+		if (!node) return 0;
+
+		std::size_t l=0, r=0;
+		if(node->get_left()) {
+			l = check_recurse(node->get_left());
+		}
+		if(node->get_right()) {
+			r = check_recurse(node->get_right());
+		}
+
+		return l + r + (std::abs(node->get_depth_diff()) >= 2);
+	}
+
+private:
+	node_type *m_head;
+	std::size_t m_count;
+	Alloc<node_type> m_alloc;
+};
+
+
+/**
+ * Compact AVL Tree class.
+ *
+ * Same ordering rules as AVLTree, but nodes are stored by value in a
+ * single array. Children are 32-bit indices in that array instead of
+ * pointers and the height fits in a byte, so an AVLTree<int> node of
+ * 32 bytes becomes a 16-byte CompactAVLTree<int> node: four nodes per
+ * cache line, payload and links side by side.
+ *
+ * Index 0 is a sentinel with a height of 0 standing for the empty
+ * sub-tree, which removes the null checks from the depth
+ * computations. T must be default constructible for the sentinel.
+ */
+template<class T>
+class CompactAVLTree
+{
+public:
+	/**
+	 * CompactAVLTree constructor
+	 */
+	CompactAVLTree() : m_root(nil), m_free(nil)
+	{
+		m_nodes.push_back(Node{T(), nil, nil, 0});
+	}
+
+	/**
+	 * Reserve room for count elements.
+	 */
+	void reserve(std::size_t count)
+	{
+		m_nodes.reserve(count + 1);
+	}
+
+	/**
+	 * Remove all elements.
+	 */
+	void clear()
+	{
+		m_nodes.resize(1);
+		m_root = m_free = nil;
+	}
+
+	/**
+	 * Insert an element in the tree.
+	 *
+	 * @sa AVLTree::push
+	 */
+	CompactAVLTree &push(const T &value)
+	{
+		m_root = push_recurse(m_root, value);
+		return *this;
+	}
+
+	/**
+	 * Remove an element from the tree.
+	 *
+	 * @sa AVLTree::remove
+	 */
+	CompactAVLTree &remove(const T &value)
+	{
+		m_root = remove_recurse(m_root, value);
+		return *this;
+	}
+
+	/**
+	 * Return a pointer on an element equivalent to key, or nullptr if
+	 * there is none.
+	 *
+	 * @sa AVLTree::find
+	 */
+	template<class K>
+	const T *find(const K &key) const
+	{
+		std::uint32_t index = m_root;
+
+		while (index != nil) {
+			const Node &node = m_nodes[index];
+			if (key < node.data) {
+				index = node.left;
+			}
+			else if (node.data < key) {
+				index = node.right;
+			}
+			else {
+				return &node.data;
+			}
+		}
+
+		return nullptr;
+	}
+
+	/**
+	 * Return true if an element equivalent to key is in the tree.
+	 */
+	template<class K>
+	bool contains(const K &key) const
+	{
+		return find(key) != nullptr;
+	}
+
+	/**
+	 * Return a pointer on the first element that is not less than
+	 * key, or nullptr if there is none.
+	 */
+	template<class K>
+	const T *lower_bound(const K &key) const
+	{
+		std::uint32_t index = m_root;
+		const T *bound = nullptr;
+
+		while (index != nil) {
+			const Node &node = m_nodes[index];
+			if (node.data < key) {
+				index = node.right;
+			}
+			else {
+				bound = &node.data;
+				index = node.left;
+			}
+		}
+
+		return bound;
+	}
+
+	/**
+	 * Renumber the nodes in breadth-first order. The top levels of the
+	 * tree, visited by every search, end up packed in the first cache
+	 * lines of the array, and the slots of removed nodes are given
+	 * back. Pointers returned by the lookup functions are invalidated.
+	 */
+	void relayout()
+	{
+		std::vector<Node> nodes;
+		nodes.reserve(m_nodes.size() - count_free());
+		nodes.push_back(m_nodes[nil]);
+
+		if (m_root != nil) {
+			// The new array is its own BFS queue: children are appended
+			// while their parent is visited, then visited in turn.
+			nodes.push_back(m_nodes[m_root]);
+			for (std::size_t i = 1; i < nodes.size(); i++) {
+				Node &node = nodes[i];
+				if (node.left != nil) {
+					nodes.push_back(m_nodes[node.left]);
+					nodes[i].left = nodes.size() - 1;
+				}
+				if (nodes[i].right != nil) {
+					nodes.push_back(m_nodes[nodes[i].right]);
+					nodes[i].right = nodes.size() - 1;
+				}
+			}
+			m_root = 1;
+		}
+
+		m_nodes.swap(nodes);
+		m_free = nil;
+	}
+
+	/**
+	 * Return the number of bytes used by the node array.
+	 */
+	std::size_t memory_usage() const
+	{
+		return m_nodes.capacity() * sizeof(Node);
+	}
+
+	/**
+	 * Check if the tree violates the AVL property. Return the number
+	 * of errors found.
+	 */
+	std::size_t check() const
+	{
+		return check_recurse(m_root);
+	}
+
+private:
+	/**
+	 * Node stored in the array. The payload comes first so that the
+	 * key compared during a search shares its cache line with the
+	 * links followed right after.
+	 */
+	struct Node {
+		T data;
+		std::uint32_t left;
+		std::uint32_t right;
+		std::uint8_t height;
+	};
+
+	static constexpr std::uint32_t nil = 0;
+
+	/**
+	 * Get a slot for a new node, from the free list if possible.
+	 */
+	std::uint32_t create(const T &value)
+	{
+		if (m_free != nil) {
+			std::uint32_t index = m_free;
+			m_free = m_nodes[index].left;
+			m_nodes[index] = Node{value, nil, nil, 1};
+			return index;
+		}
+
+		if (m_nodes.size() > std::numeric_limits<std::uint32_t>::max()) {
+			throw std::length_error("CompactAVLTree: too many nodes");
+		}
+
+		m_nodes.push_back(Node{value, nil, nil, 1});
+		return m_nodes.size() - 1;
+	}
+
+	/**
+	 * Put a slot on the free list, linked through its left index.
+	 */
+	void destroy(std::uint32_t index)
+	{
+		m_nodes[index].left = m_free;
+		m_free = index;
+	}
+
+	std::size_t count_free() const
+	{
+		std::size_t count = 0;
+		for (std::uint32_t index = m_free; index != nil; index = m_nodes[index].left) {
+			count++;
+		}
+		return count;
+	}
+
+	int depth_diff(std::uint32_t index) const
+	{
+		const Node &node = m_nodes[index];
+		return int(m_nodes[node.right].height) - int(m_nodes[node.left].height);
+	}
+
+	void update_depth(std::uint32_t index)
+	{
+		Node &node = m_nodes[index];
+		node.height = std::max(m_nodes[node.left].height, m_nodes[node.right].height) + 1;
+	}
+
+	/**
+	 * Left rotation, see AVLTree::rotate_left.
+	 */
+	std::uint32_t rotate_left(std::uint32_t y)
+	{
+		std::uint32_t x = m_nodes[y].right;
+		m_nodes[y].right = m_nodes[x].left;
+		update_depth(y);
+		m_nodes[x].left = y;
+		update_depth(x);
+		return x;
+	}
+
+	/**
+	 * Right rotation, see AVLTree::rotate_right.
+	 */
+	std::uint32_t rotate_right(std::uint32_t y)
+	{
+		std::uint32_t x = m_nodes[y].left;
+		m_nodes[y].left = m_nodes[x].right;
+		update_depth(y);
+		m_nodes[x].right = y;
+		update_depth(x);
+		return x;
+	}
+
+	/**
+	 * Balance the sub-tree. Double rotations are done as two single
+	 * rotations.
+	 */
+	std::uint32_t balance_tree(std::uint32_t index)
+	{
+		int diff = depth_diff(index);
+
+		if (diff < -1) {
+			if (depth_diff(m_nodes[index].left) > 0) {
+				m_nodes[index].left = rotate_left(m_nodes[index].left);
+			}
+			return rotate_right(index);
+		}
+		else if (diff > 1) {
+			if (depth_diff(m_nodes[index].right) < 0) {
+				m_nodes[index].right = rotate_right(m_nodes[index].right);
+			}
+			return rotate_left(index);
+		}
+
+		return index;
+	}
+
+	/**
+	 * Recursive insertion. The node array can be reallocated by
+	 * create(), so no reference on a node is held across the
+	 * recursive call.
+	 */
+	std::uint32_t push_recurse(std::uint32_t index, const T &value)
+	{
+		if (index == nil) {
+			return create(value);
+		}
+
+		if (value < m_nodes[index].data) {
+			std::uint32_t left = push_recurse(m_nodes[index].left, value);
+			m_nodes[index].left = left;
+		}
+		else {
+			std::uint32_t right = push_recurse(m_nodes[index].right, value);
+			m_nodes[index].right = right;
+		}
+
+		update_depth(index);
+		return balance_tree(index);
+	}
+
+	/**
+	 * Unlink the smallest node of the sub-tree and store its index in
+	 * smallest. Return the new root of the sub-tree.
+	 */
+	std::uint32_t remove_smallest(std::uint32_t index, std::uint32_t &smallest)
+	{
+		if (m_nodes[index].left == nil) {
+			smallest = index;
+			return m_nodes[index].right;
+		}
+
+		m_nodes[index].left = remove_smallest(m_nodes[index].left, smallest);
+		update_depth(index);
+		return balance_tree(index);
+	}
+
+	/**
+	 * Recursive removal. A node with two children is replaced by the
+	 * smallest node of its right sub-tree, which is relinked rather
+	 * than copied.
+	 */
+	std::uint32_t remove_recurse(std::uint32_t index, const T &value)
+	{
+		if (index == nil) return nil;
+
+		Node &node = m_nodes[index];
+
+		if (value < node.data) {
+			node.left = remove_recurse(node.left, value);
+		}
+		else if (node.data < value) {
+			node.right = remove_recurse(node.right, value);
+		}
+		else {
+			std::uint32_t left = node.left;
+			std::uint32_t right = node.right;
+			destroy(index);
+
+			if (left == nil) return right;
+			if (right == nil) return left;
+
+			std::uint32_t smallest;
+			right = remove_smallest(right, smallest);
+			m_nodes[smallest].left = left;
+			m_nodes[smallest].right = right;
+			index = smallest;
+		}
+
+		update_depth(index);
+		return balance_tree(index);
+	}
+
+	std::size_t check_recurse(std::uint32_t index) const
+	{
+		if (index == nil) return 0;
+
+		const Node &node = m_nodes[index];
+		return check_recurse(node.left) + check_recurse(node.right) +
+			(std::abs(depth_diff(index)) >= 2);
+	}
+
+private:
+	std::vector<Node> m_nodes;
+	std::uint32_t m_root;
+	std::uint32_t m_free;
+};
+
+
+/**
+ * Epoch based reclamation domain, shared by all the concurrent trees.
+ *
+ * A reader pins the current epoch in its thread slot while it walks a
+ * tree. A writer tags each node it unlinks with the epoch in force
+ * after the unlink, then bumps the epoch. The node is freed once no
+ * thread is pinned at an epoch lower or equal to its tag: every reader
+ * that could still see it is gone.
+ */
+class EpochDomain
+{
+	/**
+	 * Per thread slot holding the pinned epoch, 0 when the thread is
+	 * not reading.
+	 */
+	struct alignas(64) Slot {
+		std::atomic<std::uint64_t> epoch;
+		std::atomic<bool> used;
+		unsigned nesting;
+	};
+
+public:
+	static constexpr std::size_t max_threads = 256;
+
+	/**
+	 * Pin the calling thread to the current epoch for the lifetime of
+	 * the guard. Guards can be nested.
+	 */
+	class Guard
+	{
+	public:
+		Guard() : m_slot(EpochDomain::instance().local_slot())
+		{
+			if (m_slot.nesting++ == 0) {
+				std::uint64_t epoch = EpochDomain::instance().m_epoch.load(std::memory_order_acquire);
+				m_slot.epoch.store(epoch, std::memory_order_relaxed);
+				// Pairs with the fence of advance(): either the writer sees
+				// this slot, or this reader sees the new root.
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+			}
+		}
+
+		Guard(const Guard &) = delete;
+		Guard &operator=(const Guard &) = delete;
+
+		~Guard()
+		{
+			if (--m_slot.nesting == 0) {
+				m_slot.epoch.store(0, std::memory_order_release);
+			}
+		}
+
+	private:
+		Slot &m_slot;
+	};
+
+	static EpochDomain &instance()
+	{
+		static EpochDomain domain;
+		return domain;
+	}
+
+	/**
+	 * Return the epoch to tag a node unlinked before the call.
+	 */
+	std::uint64_t retire_epoch() const
+	{
+		return m_epoch.load(std::memory_order_seq_cst);
+	}
+
+	/**
+	 * Start a new epoch and return the oldest epoch at which a thread
+	 * is still pinned. Nodes tagged before that epoch can be freed.
+	 */
+	std::uint64_t advance()
+	{
+		std::uint64_t oldest = m_epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		for (auto &slot: m_slots) {
+			std::uint64_t epoch = slot.epoch.load(std::memory_order_acquire);
+			if (epoch != 0 && epoch < oldest) {
+				oldest = epoch;
+			}
+		}
+
+		return oldest;
+	}
+
+private:
+	/**
+	 * Give the slot back when its thread exits.
+	 */
+	struct SlotOwner {
+		Slot *slot = nullptr;
+
+		~SlotOwner()
+		{
+			if (slot) {
+				slot->used.store(false, std::memory_order_release);
+			}
+		}
+	};
+
+	EpochDomain() : m_epoch(1)
+	{
+		for (auto &slot: m_slots) {
+			slot.epoch.store(0);
+			slot.used.store(false);
+			slot.nesting = 0;
+		}
+	}
+
+	Slot &local_slot()
+	{
+		static thread_local SlotOwner owner;
+
+		if (!owner.slot) {
+			for (auto &slot: m_slots) {
+				bool used = false;
+				if (slot.used.compare_exchange_strong(used, true)) {
+					owner.slot = &slot;
+					break;
+				}
+			}
+			if (!owner.slot) {
+				throw std::runtime_error("EpochDomain: too many threads");
+			}
+		}
+
+		return *owner.slot;
+	}
+
+private:
+	std::atomic<std::uint64_t> m_epoch;
+	Slot m_slots[max_threads];
+};
+
+
+/**
+ * Concurrent AVL Tree class.
+ *
+ * Readers never take a lock. Published nodes are immutable: a writer
+ * copies the path from the root to the nodes it changes (O(log n)
+ * nodes, rotations included), then publishes the new root with a
+ * single atomic store. Readers load the root and walk a consistent
+ * version of the tree. Replaced nodes are freed through the
+ * EpochDomain once no reader can reach them anymore.
+ *
+ * Writers are serialized by a mutex, which also protects the node
+ * allocator and the list of retired nodes.
+ *
+ * Lookups copy the element found instead of returning a pointer: the
+ * node may be freed as soon as the lookup returns.
+ */
+template<class T, template<class> class Alloc = NodePool>
+class ConcurrentAVLTree
+{
+public:
+	typedef Node<T> node_type;
+
+	/**
+	 * ConcurrentAVLTree constructor
+	 */
+	ConcurrentAVLTree() : m_head(nullptr), m_count(0) {}
+
+	ConcurrentAVLTree(const ConcurrentAVLTree &) = delete;
+	ConcurrentAVLTree &operator=(const ConcurrentAVLTree &) = delete;
+
+	/**
+	 * ConcurrentAVLTree destructor. No other thread may use the tree
+	 * anymore.
+	 */
+	~ConcurrentAVLTree()
+	{
+		delete_recurse(m_head.load());
+		for (auto &retired: m_retired) {
+			m_alloc.destroy(retired.first);
+		}
+	}
+
+	/**
+	 * Insert an element in the tree.
+	 */
+	void push(const T &value)
+	{
+		std::lock_guard<std::mutex> lock(m_write);
+
+		m_head.store(push_recurse(m_head.load(std::memory_order_relaxed), value), std::memory_order_release);
+		m_count.fetch_add(1, std::memory_order_relaxed);
+		retire_pending();
+	}
+
+	/**
+	 * Remove an element from the tree. Return true if an element was
+	 * removed.
+	 */
+	bool remove(const T &value)
+	{
+		std::lock_guard<std::mutex> lock(m_write);
+
+		bool found = false;
+		node_type *head = m_head.load(std::memory_order_relaxed);
+		head = remove_recurse(head, value, found);
+
+		if (found) {
+			m_head.store(head, std::memory_order_release);
+			m_count.fetch_sub(1, std::memory_order_relaxed);
+			retire_pending();
+		}
+
+		return found;
+	}
+
+	/**
+	 * Copy an element equivalent to key in result. Return false if
+	 * there is none.
+	 */
+	template<class K>
+	bool find(const K &key, T &result) const
+	{
+		EpochDomain::Guard guard;
+
+		const node_type *node = m_head.load(std::memory_order_acquire);
+		while (node) {
+			const T &data = node->get_data();
+			if (key < data) {
+				node = node->get_left();
+			}
+			else if (data < key) {
+				node = node->get_right();
+			}
+			else {
+				result = data;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	/**
+	 * Return true if an element equivalent to key is in the tree.
+	 */
+	template<class K>
+	bool contains(const K &key) const
+	{
+		EpochDomain::Guard guard;
+
+		const node_type *node = m_head.load(std::memory_order_acquire);
+		while (node) {
+			const T &data = node->get_data();
+			if (key < data) {
+				node = node->get_left();
+			}
+			else if (data < key) {
+				node = node->get_right();
+			}
+			else {
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	/**
+	 * Copy the first element not less than key in result. Return false
+	 * if there is none.
+	 */
+	template<class K>
+	bool lower_bound(const K &key, T &result) const
+	{
+		EpochDomain::Guard guard;
+
+		const node_type *node = m_head.load(std::memory_order_acquire);
+		const node_type *bound = nullptr;
+		while (node) {
+			if (node->get_data() < key) {
+				node = node->get_right();
+			}
+			else {
+				bound = node;
+				node = node->get_left();
+			}
+		}
+
+		if (bound) {
+			result = bound->get_data();
+		}
+		return bound != nullptr;
+	}
+
+	/**
+	 * Return the number of elements stored in the tree.
+	 */
+	std::size_t size() const
+	{
+		return m_count.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * Check if the current version of the tree violates the AVL
+	 * property. Return the number of errors found.
+	 */
+	std::size_t check() const
+	{
+		EpochDomain::Guard guard;
+		return check_recurse(m_head.load(std::memory_order_acquire));
+	}
+
+private:
+	/**
+	 * Number of retired nodes that triggers a reclamation attempt.
+	 */
+	static constexpr std::size_t reclaim_threshold = 1024;
+
+	static std::size_t depth(const node_type *node)
+	{
+		return node ? node->get_depth() : 0;
+	}
+
+	/**
+	 * Create a new node. It stays private to the writer until the next
+	 * root publication, so it can be set up with plain stores.
+	 */
+	node_type *make(const T &data, node_type *left, node_type *right)
+	{
+		node_type *node = m_alloc.create(data, nullptr);
+		node->set_left(left);
+		node->set_right(right);
+		node->update_depth();
+		return node;
+	}
+
+	/**
+	 * Queue a node replaced by the current write operation. It is
+	 * tagged and freed later by retire_pending().
+	 */
+	void retire(node_type *node)
+	{
+		m_pending.push_back(node);
+	}
+
+	/**
+	 * Tag the nodes replaced by the last write, which is now published,
+	 * and free the retired nodes no reader can reach anymore.
+	 */
+	void retire_pending()
+	{
+		EpochDomain &domain = EpochDomain::instance();
+		// Pairs with the fence of Guard(): the root store above cannot
+		// sink below the epoch read, so only readers pinned at or
+		// before the tag can still hold the nodes retired here.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		std::uint64_t epoch = domain.retire_epoch();
+
+		for (node_type *node: m_pending) {
+			m_retired.emplace_back(node, epoch);
+		}
+		m_pending.clear();
+
+		if (m_retired.size() < reclaim_threshold) return;
+
+		std::uint64_t oldest = domain.advance();
+		auto kept = std::partition(m_retired.begin(), m_retired.end(),
+		                           [oldest](const std::pair<node_type *, std::uint64_t> &retired) {
+			                           return retired.second >= oldest;
+		                           });
+		for (auto it = kept; it != m_retired.end(); ++it) {
+			m_alloc.destroy(it->first);
+		}
+		m_retired.erase(kept, m_retired.end());
+	}
+
+	/**
+	 * Build a balanced sub-tree from a payload and two sub-trees whose
+	 * depths differ by at most 2. The nodes replaced by a rotation are
+	 * retired. This is AVLTree::balance_tree without mutation.
+	 */
+	node_type *balance(const T &data, node_type *left, node_type *right)
+	{
+		if (depth(left) > depth(right) + 1) {
+			node_type *a = left->get_left();
+			node_type *b = left->get_right();
+			retire(left);
+
+			if (depth(a) >= depth(b)) {
+				return make(left->get_data(), a, make(data, b, right));
+			}
+
+			retire(b);
+			return make(b->get_data(),
+			            make(left->get_data(), a, b->get_left()),
+			            make(data, b->get_right(), right));
+		}
+
+		if (depth(right) > depth(left) + 1) {
+			node_type *b = right->get_left();
+			node_type *c = right->get_right();
+			retire(right);
+
+			if (depth(c) >= depth(b)) {
+				return make(right->get_data(), make(data, left, b), c);
+			}
+
+			retire(b);
+			return make(b->get_data(),
+			            make(data, left, b->get_left()),
+			            make(right->get_data(), b->get_right(), c));
+		}
+
+		return make(data, left, right);
+	}
+
+	node_type *push_recurse(node_type *node, const T &value)
+	{
+		if (!node) {
+			return make(value, nullptr, nullptr);
+		}
+
+		node_type *result;
+		if (value < node->get_data()) {
+			result = balance(node->get_data(), push_recurse(node->get_left(), value), node->get_right());
+		}
+		else {
+			result = balance(node->get_data(), node->get_left(), push_recurse(node->get_right(), value));
+		}
+
+		retire(node);
+		return result;
+	}
+
+	/**
+	 * Unlink the smallest node of the sub-tree and store it in
+	 * smallest. Return the new sub-tree.
+	 */
+	node_type *remove_smallest(node_type *node, node_type *&smallest)
+	{
+		if (!node->get_left()) {
+			smallest = node;
+			return node->get_right();
+		}
+
+		node_type *result = balance(node->get_data(), remove_smallest(node->get_left(), smallest), node->get_right());
+		retire(node);
+		return result;
+	}
+
+	/**
+	 * Remove value from the sub-tree. When it is not found, nothing is
+	 * copied and the sub-tree is returned as is.
+	 */
+	node_type *remove_recurse(node_type *node, const T &value, bool &found)
+	{
+		if (!node) return nullptr;
+
+		const T &data = node->get_data();
+		node_type *left = node->get_left();
+		node_type *right = node->get_right();
+		node_type *result;
+
+		if (value < data) {
+			left = remove_recurse(left, value, found);
+			if (!found) return node;
+			result = balance(data, left, right);
+		}
+		else if (data < value) {
+			right = remove_recurse(right, value, found);
+			if (!found) return node;
+			result = balance(data, left, right);
+		}
+		else {
+			found = true;
+			if (!left) {
+				result = right;
+			}
+			else if (!right) {
+				result = left;
+			}
+			else {
+				node_type *smallest;
+				right = remove_smallest(right, smallest);
+				result = balance(smallest->get_data(), left, right);
+				retire(smallest);
+			}
+		}
+
+		retire(node);
+		return result;
+	}
+
+	void delete_recurse(node_type *node)
+	{
+		if (node) {
+			delete_recurse(node->get_left());
+			delete_recurse(node->get_right());
+			m_alloc.destroy(node);
+		}
+	}
+
+	std::size_t check_recurse(const node_type *node) const
+	{
+		if (!node) return 0;
+
+		return check_recurse(node->get_left()) + check_recurse(node->get_right()) +
+			(std::abs(node->get_depth_diff()) >= 2);
+	}
+
+private:
+	std::atomic<node_type *> m_head;
+	std::atomic<std::size_t> m_count;
+	std::mutex m_write;
+	std::vector<node_type *> m_pending;
+	std::vector<std::pair<node_type *, std::uint64_t>> m_retired;
+	Alloc<node_type> m_alloc;
+};
+
+
+/**
+ * Persistent AVL Tree class.
+ *
+ * Nodes are reference counted and shared between versions of the
+ * tree. snapshot() (or a copy) is O(1): it only takes a reference on
+ * the root. A node is copied before being modified when another
+ * version still references it, so push and remove copy at most the
+ * O(log n) nodes of the path they touch. Nodes owned by a single
+ * version are modified in place, like in AVLTree.
+ *
+ * A version must only be used by one thread at a time, but distinct
+ * versions sharing nodes can be used and destroyed from different
+ * threads. Nodes are allocated with new, since they can outlive the
+ * version that created them.
+ */
+template<class T>
+class PersistentAVLTree
+{
+public:
+	/**
+	 * PersistentAVLTree constructor
+	 */
+	PersistentAVLTree() : m_head(nullptr), m_count(0) {}
+
+	/**
+	 * Copy constructor. The copy shares all the nodes, see snapshot().
+	 */
+	PersistentAVLTree(const PersistentAVLTree &tree) :
+		m_head(acquire(tree.m_head)),
+		m_count(tree.m_count)
+	{}
+
+	PersistentAVLTree(PersistentAVLTree &&tree) :
+		m_head(tree.m_head),
+		m_count(tree.m_count)
+	{
+		tree.m_head = nullptr;
+		tree.m_count = 0;
+	}
+
+	PersistentAVLTree &operator=(PersistentAVLTree tree)
+	{
+		std::swap(m_head, tree.m_head);
+		std::swap(m_count, tree.m_count);
+		return *this;
+	}
+
+	/**
+	 * PersistentAVLTree destructor. Free the nodes not referenced by
+	 * another version.
+	 */
+	~PersistentAVLTree()
+	{
+		release(m_head);
+	}
+
+	/**
+	 * Return a frozen version of the tree in O(1). Later changes of
+	 * either version are not seen by the other one.
+	 */
+	PersistentAVLTree snapshot() const
+	{
+		return *this;
+	}
+
+	/**
+	 * Insert an element in the tree.
+	 */
+	PersistentAVLTree &push(const T &value)
+	{
+		m_head = push_recurse(m_head, value);
+		m_count++;
+		return *this;
+	}
+
+	/**
+	 * Remove an element from the tree. Return true if an element was
+	 * removed. Nothing is copied when the element is not found.
+	 */
+	bool remove(const T &value)
+	{
+		if (!contains(value)) return false;
+
+		m_head = remove_recurse(m_head, value);
+		m_count--;
+		return true;
+	}
+
+	/**
+	 * Return a pointer on an element equivalent to key, or nullptr if
+	 * there is none. The pointer is valid until this version changes.
+	 */
+	template<class K>
+	const T *find(const K &key) const
+	{
+		const PersistentNode *node = m_head;
+
+		while (node) {
+			if (key < node->data) {
+				node = node->left;
+			}
+			else if (node->data < key) {
+				node = node->right;
+			}
+			else {
+				return &node->data;
+			}
+		}
+
+		return nullptr;
+	}
+
+	/**
+	 * Return true if an element equivalent to key is in the tree.
+	 */
+	template<class K>
+	bool contains(const K &key) const
+	{
+		return find(key) != nullptr;
+	}
+
+	/**
+	 * Call f on each element, in order.
+	 */
+	template<class F>
+	void visit(F f) const
+	{
+		visit_recurse(m_head, f);
+	}
+
+	/**
+	 * Return the number of elements stored in the tree.
+	 */
+	std::size_t size() const
+	{
+		return m_count;
+	}
+
+	/**
+	 * Check if the tree violates the AVL property. Return the number
+	 * of errors found.
+	 */
+	std::size_t check() const
+	{
+		return check_recurse(m_head);
+	}
+
+private:
+	/**
+	 * Shared node. Each parent, and each version for its root, holds
+	 * one reference.
+	 */
+	struct PersistentNode {
+		PersistentNode(const T &value, PersistentNode *l, PersistentNode *r, std::size_t d) :
+			data(value), left(l), right(r), depth(d), refs(1)
+		{}
+
+		T data;
+		PersistentNode *left;
+		PersistentNode *right;
+		std::size_t depth;
+		std::atomic<std::size_t> refs;
+	};
+
+	static PersistentNode *acquire(PersistentNode *node)
+	{
+		if (node) {
+			node->refs.fetch_add(1, std::memory_order_relaxed);
+		}
+		return node;
+	}
+
+	/**
+	 * Drop a reference. The last one frees the node and drops the
+	 * references it holds on its sub-nodes.
 	 */
-	Node<T> *rotate_left_right(Node<T> *node) const
+	static void release(PersistentNode *node)
 	{
-		Node<T> *Z = node;
-		Node<T> *Y = Z->get_left();
-		Node<T> *X = Y->get_right();
-		Node<T> *a = Y->get_left();
-		Node<T> *b = X->get_left();
-		Node<T> *c = X->get_right();
-		Node<T> *d = Z->get_right();
+		if (node && node->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			release(node->left);
+			release(node->right);
+			delete node;
+		}
+	}
 
-		Y->set_left(a);
-		Y->set_right(b);
-		Y->update_depth();
+	/**
+	 * Take a reference on node and return a node that can be modified:
+	 * node itself if no other version references it, a copy
+	 * otherwise.
+	 */
+	static PersistentNode *unshare(PersistentNode *node)
+	{
+		if (node->refs.load(std::memory_order_acquire) == 1) {
+			return node;
+		}
 
-		Z->set_left(c);
-		Z->set_right(d);
-		Z->update_depth();
+		PersistentNode *copy = new PersistentNode(node->data, acquire(node->left),
+		                                          acquire(node->right), node->depth);
+		release(node);
+		return copy;
+	}
 
-		X->set_left(Y);
-		X->set_right(Z);
-		X->update_depth();
+	static std::size_t depth(const PersistentNode *node)
+	{
+		return node ? node->depth : 0;
+	}
 
-		return X;
+	static int64_t depth_diff(const PersistentNode *node)
+	{
+		return int64_t(depth(node->right)) - int64_t(depth(node->left));
+	}
+
+	static void update_depth(PersistentNode *node)
+	{
+		node->depth = std::max(depth(node->left), depth(node->right)) + 1;
 	}
 
 	/**
-	 * Balance the tree. Call the right rotation depending on the
-	 * sub-nodes depth.
+	 * Left rotation of an unshared node, see AVLTree::rotate_left.
+	 * The right sub-node is modified, so it is unshared first.
 	 */
-	Node<T> *balance_tree(Node<T> *node) const {
-		if (!node) return nullptr;
+	static PersistentNode *rotate_left(PersistentNode *y)
+	{
+		PersistentNode *x = unshare(y->right);
+		y->right = x->left;
+		update_depth(y);
+		x->left = y;
+		update_depth(x);
+		return x;
+	}
+
+	/**
+	 * Right rotation of an unshared node, see AVLTree::rotate_right.
+	 */
+	static PersistentNode *rotate_right(PersistentNode *y)
+	{
+		PersistentNode *x = unshare(y->left);
+		y->left = x->right;
+		update_depth(y);
+		x->right = y;
+		update_depth(x);
+		return x;
+	}
+
+	/**
+	 * Balance an unshared node. Double rotations are done as two
+	 * single rotations.
+	 */
+	static PersistentNode *balance_tree(PersistentNode *node)
+	{
+		int64_t diff = depth_diff(node);
 
-		int64_t diff = node->get_depth_diff();
 		if (diff < -1) {
-			Node<T> *left = node->get_left();
-			if (left) {
-				int64_t diff_left = left->get_depth_diff();
-				if(diff_left <= 0) {
-					return rotate_right(node);
-				}
-				else {
-					return rotate_left_right(node);
-				}
+			if (depth_diff(node->left) > 0) {
+				node->left = rotate_left(unshare(node->left));
 			}
+			return rotate_right(node);
 		}
 		else if (diff > 1) {
-			Node<T> *right = node->get_right();
-			if (right) {
-				int64_t diff_right = right->get_depth_diff();
-				if(diff_right >= 0) {
-					return rotate_left(node);
-				}
-				else {
-					return rotate_right_left(node);
-				}
+			if (depth_diff(node->right) < 0) {
+				node->right = rotate_right(unshare(node->right));
 			}
+			return rotate_left(node);
 		}
 
-		assert(std::abs(node->get_depth_diff())<=1);
-
 		return node;
 	}
 
 	/**
-	 * Push the value by recursively searching for the right place in
-	 * the node. After insertion, apply the proper rotation depending
-	 * on tree depth.
-	 *
-	 * There is four balance cases:
-	 *
-	 * - left rotation: the node has a 2 sub-tree depth difference and
-	 *   the right son a 1 difference.
-	 *
-	 * - right rotation: The node has a -2 sub-tree depth difference
-	 *   and the left son a -1 difference.
-	 *
-	 * - double right left rotation: The node has a 2 sub-tree depth
-	 *   difference and the right son a -1 difference.
-	 *
-	 * - double left right rotation: The node has a -2 subtree depth
-	 *   difference and the left son a -1 difference.
-	 *
+	 * All recursive functions take over the reference held on the
+	 * given node and return a reference on the new sub-tree root.
 	 */
-	Node<T> *push_recurse(Node<T> *node, const T &value) const
+	static PersistentNode *push_recurse(PersistentNode *node, const T &value)
 	{
-		if (node == nullptr) {
-			return new Node<T>(value, node);
+		if (!node) {
+			return new PersistentNode(value, nullptr, nullptr, 1);
 		}
 
-		if(value < node->get_data()) {
-			node->set_left(push_recurse(node->get_left(), value));
+		node = unshare(node);
+		if (value < node->data) {
+			node->left = push_recurse(node->left, value);
 		}
 		else {
-			node->set_right(push_recurse(node->get_right(), value));
+			node->right = push_recurse(node->right, value);
 		}
 
-		node->update_depth();
+		update_depth(node);
+		return balance_tree(node);
+	}
+
+	/**
+	 * Unlink the smallest node of the sub-tree and store it, unshared
+	 * and without sub-nodes, in smallest.
+	 */
+	static PersistentNode *remove_smallest(PersistentNode *node, PersistentNode *&smallest)
+	{
+		node = unshare(node);
+
+		if (!node->left) {
+			PersistentNode *right = node->right;
+			node->right = nullptr;
+			smallest = node;
+			return right;
+		}
 
+		node->left = remove_smallest(node->left, smallest);
+		update_depth(node);
 		return balance_tree(node);
 	}
 
 	/**
-	 * Search for the largest node. Mark to nullptr the parent that
-	 * points to it and return the pointer to the largest node.
-	 * Balance the tree during the recursion unwinding.
+	 * Remove value, which must be in the sub-tree.
 	 */
-	Node<T> *remove_largest(Node<T> *parent, Node<T> *node) const
+	static PersistentNode *remove_recurse(PersistentNode *node, const T &value)
 	{
-		Node<T> *right = node->get_right();
-		Node<T> *rnode;
+		node = unshare(node);
 
-		if(!right) {
-			parent->set_right(node->get_left());
-			return node;
+		if (value < node->data) {
+			node->left = remove_recurse(node->left, value);
+		}
+		else if (node->data < value) {
+			node->right = remove_recurse(node->right, value);
 		}
 		else {
-			rnode = remove_largest(node, right);
+			PersistentNode *left = node->left;
+			PersistentNode *right = node->right;
+			node->left = node->right = nullptr;
+			release(node);
+
+			if (!left) return right;
+			if (!right) return left;
+
+			// The smallest node of the right sub-tree takes the place of
+			// the removed one.
+			right = remove_smallest(right, node);
+			node->left = left;
+			node->right = right;
 		}
 
-		node->update_depth();
+		update_depth(node);
+		return balance_tree(node);
+	}
 
-		if (parent->get_left() == node)
-			parent->set_left(balance_tree(node));
+	template<class F>
+	static void visit_recurse(const PersistentNode *node, F &f)
+	{
+		if (node) {
+			visit_recurse(node->left, f);
+			f(node->data);
+			visit_recurse(node->right, f);
+		}
+	}
 
-		if (parent->get_right() == node)
-			parent->set_right(balance_tree(node));
+	static std::size_t check_recurse(const PersistentNode *node)
+	{
+		if (!node) return 0;
 
-		return rnode;
+		return check_recurse(node->left) + check_recurse(node->right) +
+			(std::abs(depth_diff(node)) >= 2);
 	}
 
-	/**
-	 * Remove a node and apply rotations during the ascent of each
-	 * parent until the root to keep the tree properly balanced.
-	 */
-	Node<T> *remove_recurse(Node<T> *node, const T &value) const
-	{
-		Node<T> *left = node->get_left();
-		Node<T> *right = node->get_right();
-		const T &data = node->get_data();
+private:
+	PersistentNode *m_head;
+	std::size_t m_count;
+};
 
-		if(value < data) {
-			if(left) {
-				node->set_left(remove_recurse(left, value));
-			}
-		}
-		else if(value > data) {
-			if(right) {
-				node->set_right(remove_recurse(right, value));
-			}
+
+
+/**
+ * Return the time in seconds taken by f().
+ */
+template<class F>
+double measure(F f)
+{
+	auto start = std::chrono::steady_clock::now();
+	f();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count();
+}
+
+
+/**
+ * Compare the pointer based and the compact node layouts: insertion
+ * of count random keys, then count random lookups.
+ */
+void bench_layout(std::size_t count)
+{
+	std::vector<int> keys(count);
+	for (auto &key: keys) {
+		key = std::rand();
+	}
+
+	std::size_t found = 0;
+	AVLTree<int> tree;
+	CompactAVLTree<int> compact;
+	compact.reserve(count);
+
+	double tree_push = measure([&] {for (int key: keys) tree.push(key);});
+	double compact_push = measure([&] {for (int key: keys) compact.push(key);});
+
+	std::shuffle(keys.begin(), keys.end(), std::mt19937(0));
+
+	double tree_find = measure([&] {for (int key: keys) found += tree.contains(key);});
+	double compact_find = measure([&] {for (int key: keys) found += compact.contains(key);});
+	compact.relayout();
+	double relayout_find = measure([&] {for (int key: keys) found += compact.contains(key);});
+
+	std::cout << "layout benchmark, " << count << " keys (" << found << " found)\n"
+	          << "  AVLTree<int>        " << sizeof(Node<int>) << " B/node, push "
+	          << tree_push << " s, find " << tree_find << " s\n"
+	          << "  CompactAVLTree<int> " << compact.memory_usage() / (count + 1) << " B/node, push "
+	          << compact_push << " s, find " << compact_find << " s, find after relayout "
+	          << relayout_find << " s" << std::endl;
+}
+
+
+
+
+/**
+ * Compare merging two trees of count / 2 random keys by pushing every
+ * element of one into the other, and with AVLTree::unite.
+ */
+void bench_set_operations(std::size_t count)
+{
+	std::vector<int> a_keys(count / 2), b_keys(count / 2);
+	for (std::size_t i = 0; i < count / 2; i++) {
+		a_keys[i] = std::rand();
+		b_keys[i] = std::rand();
+	}
+	std::sort(a_keys.begin(), a_keys.end());
+	std::sort(b_keys.begin(), b_keys.end());
+
+	AVLTree<int> pushed(a_keys.begin(), a_keys.end());
+	AVLTree<int> a(a_keys.begin(), a_keys.end());
+	AVLTree<int> b(b_keys.begin(), b_keys.end());
+
+	double push_time = measure([&] {for (int key: b_keys) pushed.push(key);});
+	double unite_time = measure([&] {a.unite(std::move(b));});
+
+	std::cout << "set operations benchmark, " << count << " keys, "
+	          << std::thread::hardware_concurrency() << " threads\n"
+	          << "  push each element " << push_time << " s\n"
+	          << "  unite             " << unite_time << " s" << std::endl;
+}
+
+/**
+ * Compare the read/write throughput of ConcurrentAVLTree and of an
+ * AVLTree behind a mutex. Each thread runs a mix of 95% lookups and 5%
+ * pushes or removes on a tree of count random keys.
+ */
+void bench_concurrent(std::size_t count)
+{
+	struct LockedAVLTree {
+		AVLTree<int> tree;
+		std::mutex mutex;
+
+		void push(int key) {std::lock_guard<std::mutex> lock(mutex); tree.push(key);}
+		void remove(int key) {std::lock_guard<std::mutex> lock(mutex); tree.remove(key);}
+		bool contains(int key) {std::lock_guard<std::mutex> lock(mutex); return tree.contains(key);}
+	};
+
+	const unsigned threads = std::max(4u, std::thread::hardware_concurrency());
+	const std::size_t operations = 1000000;
+	const int range = count * 2;
+
+	auto run = [&](auto &tree) {
+		for (std::size_t i = 0; i < count; i++) {
+			tree.push(std::rand() % range);
 		}
-		else if (value == data) {
-			// We must find the largest payload of the left sub-nodes and
-			// replace it within the found node. Then the tree has to be
-			// balanced from the current node to the root during the
-			// recursion unwinding.
 
-			if(!left && !right) {
-				// Node is a leaf, we just delete it.
-				delete node;
-				return nullptr;
+		std::atomic<std::size_t> found(0);
+		double elapsed = measure([&] {
+			std::vector<std::thread> workers;
+			for (unsigned t = 0; t < threads; t++) {
+				workers.emplace_back([&, t] {
+					std::mt19937 random(t);
+					std::size_t hits = 0;
+					for (std::size_t i = 0; i < operations; i++) {
+						int key = random() % range;
+						switch (i % 40) {
+						case 0: tree.push(key); break;
+						case 20: tree.remove(key); break;
+						default: hits += tree.contains(key);
+						}
+					}
+					found += hits;
+				});
 			}
-			else if(!left && right) {
-				// Node has only a right sub-node. The tree is an AVL, so
-				// the depth of this sub-node is 1. We can safely remove
-				// the right node.
-				node->set_right(nullptr);
-				node->set_data(right->get_data());
-				delete right;
-			}
-			else {
-				if (!left->get_right()) {
-					node->set_left(left->get_left());
-					delete left;
-				}
-				else {
-					Node<T> *rnode = remove_largest(node, left);
-					node->set_data(rnode->get_data());
-					delete rnode;
-				}
+			for (auto &worker: workers) {
+				worker.join();
 			}
-		}
+		});
 
-		// We must keep the tree balanced during the recursion
-		// unwinding.
-		node->update_depth();
-		return balance_tree(node);
+		return threads * operations / elapsed / 1e6;
+	};
+
+	LockedAVLTree locked;
+	ConcurrentAVLTree<int> concurrent;
+	double locked_rate = run(locked);
+	double concurrent_rate = run(concurrent);
+
+	std::cout << "concurrent benchmark, " << count << " keys, " << threads << " threads, 5% writes\n"
+	          << "  AVLTree + mutex   " << locked_rate << " Mops/s\n"
+	          << "  ConcurrentAVLTree " << concurrent_rate << " Mops/s" << std::endl;
+}
+
+/**
+ * Measure the save, load and mapped lookup throughput of a tree of
+ * count random keys.
+ */
+void bench_serialization(std::size_t count)
+{
+	const std::string path = "avltree_bench.bin";
+	std::vector<std::uint64_t> keys(count);
+	for (auto &key: keys) {
+		key = std::rand();
 	}
+	std::sort(keys.begin(), keys.end());
 
-	std::size_t check_recurse(Node<T> *node) const {
-		if (!node) return 0;
+	AVLTree<std::uint64_t> tree(keys.begin(), keys.end());
+	AVLTree<std::uint64_t> loaded;
+	double bytes = count * sizeof(std::uint64_t);
 
-		std::size_t l=0, r=0;
-		if(node->get_left()) {
-			l = check_recurse(node->get_left());
+	double save_time = measure([&] {tree.save(path);});
+	double load_time = measure([&] {loaded.load(path);});
+
+	std::size_t found = 0;
+	double find_time = measure([&] {
+		MappedAVLFile<std::uint64_t> file(path);
+		for (std::size_t i = 0; i < count; i += 16) {
+			found += file.contains(keys[i]);
 		}
-		if(node->get_right()) {
-			r = check_recurse(node->get_right());
+	});
+	std::remove(path.c_str());
+
+	std::cout << "serialization benchmark, " << count << " keys (" << found << " found)\n"
+	          << "  save " << bytes / save_time / 1e9 << " GB/s\n"
+	          << "  load " << bytes / load_time / 1e9 << " GB/s\n"
+	          << "  mapped lookups " << (count / 16) / find_time / 1e6 << " Mops/s" << std::endl;
+}
+
+/**
+ * Insert half of count random keys into a tree holding the other half,
+ * in batches of 50000 keys, with AVLTree::push and AVLTree::push_batch.
+ */
+void bench_batch(std::size_t count)
+{
+	const std::size_t batch_size = 50000;
+	std::vector<int> keys(count / 2), batch_keys(count / 2);
+	for (std::size_t i = 0; i < count / 2; i++) {
+		keys[i] = std::rand();
+		batch_keys[i] = std::rand();
+	}
+	std::sort(keys.begin(), keys.end());
+
+	AVLTree<int> pushed(keys.begin(), keys.end());
+	AVLTree<int> batched(keys.begin(), keys.end());
+
+	double push_time = measure([&] {for (int key: batch_keys) pushed.push(key);});
+	double batch_time = measure([&] {
+		for (std::size_t i = 0; i < batch_keys.size(); i += batch_size) {
+			auto first = batch_keys.begin() + i;
+			batched.push_batch(first, first + std::min(batch_size, batch_keys.size() - i));
 		}
+	});
 
-		return l + r + (std::abs(node->get_depth_diff()) >= 2);
+	std::cout << "batch benchmark, " << count / 2 << " keys into " << count / 2
+	          << ", batches of " << batch_size << "\n"
+	          << "  push       " << push_time << " s\n"
+	          << "  push_batch " << batch_time << " s" << std::endl;
+}
+
+/**
+ * Compare lookups in an AVLTree and in its frozen copy, on count
+ * random keys.
+ */
+void bench_frozen(std::size_t count)
+{
+	std::vector<int> keys(count);
+	for (auto &key: keys) {
+		key = std::rand();
 	}
 
-private:
-	Node<T> *m_head;
-};
+	AVLTree<int> tree(keys.begin(), keys.end(), false);
+	FrozenAVLTree<int> frozen = tree.freeze();
+	std::shuffle(keys.begin(), keys.end(), std::mt19937(0));
+
+	std::size_t found = 0;
+	double tree_time = measure([&] {for (int key: keys) found += tree.contains(key);});
+	double frozen_time = measure([&] {for (int key: keys) found += frozen.contains(key);});
+
+	std::cout << "frozen benchmark, " << count << " keys (" << found << " found)\n"
+	          << "  AVLTree       " << count / tree_time / 1e6 << " Mops/s\n"
+	          << "  FrozenAVLTree " << count / frozen_time / 1e6 << " Mops/s" << std::endl;
+}
+
+/**
+ * Compare an AVLTree and a multiset mode AVLTree on count keys drawn
+ * from a Zipf distribution (exponent 1.1 over a million keys).
+ */
+void bench_multiset(std::size_t count)
+{
+	const std::size_t universe = 1000000;
+	std::vector<double> weights(universe);
+	for (std::size_t rank = 0; rank < universe; rank++) {
+		weights[rank] = 1.0 / std::pow(rank + 1, 1.1);
+	}
+
+	std::mt19937 random(0);
+	std::discrete_distribution<int> zipf(weights.begin(), weights.end());
+	std::vector<int> keys(count);
+	for (auto &key: keys) {
+		key = zipf(random);
+	}
+
+	std::vector<int> distinct = keys;
+	std::sort(distinct.begin(), distinct.end());
+	distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+
+	typedef AVLTree<int> Plain;
+	typedef AVLTree<int, NodePool, false, true> Multi;
+	Plain plain;
+	Multi multi;
+
+	double plain_push = measure([&] {for (int key: keys) plain.push(key);});
+	double multi_push = measure([&] {for (int key: keys) multi.push(key);});
 
+	std::size_t found = 0;
+	double plain_find = measure([&] {for (int key: keys) found += plain.contains(key);});
+	double multi_find = measure([&] {for (int key: keys) found += multi.contains(key);});
 
+	std::cout << "multiset benchmark, " << count << " Zipf keys, " << distinct.size()
+	          << " distinct (" << found << " found)\n"
+	          << "  AVLTree  " << count * sizeof(Plain::node_type) / 1e6 << " MB, depth "
+	          << plain.depth() << ", push " << plain_push << " s, find " << plain_find << " s\n"
+	          << "  multiset " << distinct.size() * sizeof(Multi::node_type) / 1e6 << " MB, depth "
+	          << multi.depth() << ", push " << multi_push << " s, find " << multi_find << " s" << std::endl;
+}
 
-int main() {
+int main(int argc, char **argv) {
 	std::srand(0);
 
+	if (argc > 1 && std::string(argv[1]) == "bench") {
+		std::size_t count = argc > 2 ? std::stoul(argv[2]) : 10000000;
+		bench_layout(count);
+		bench_set_operations(count);
+		bench_concurrent(std::min<std::size_t>(count, 1000000));
+		bench_serialization(count);
+		bench_frozen(count);
+		bench_multiset(count);
+		bench_batch(count);
+		return 0;
+	}
+
 	AVLTree<int> tree;
 	for(std::size_t i=0; i<100;i++) {
 		tree.push((std::rand() % 500));
@@ -616,6 +3766,329 @@ int main() {
 		total_errors += errors;
 	}
 
+	// Insert/remove churn on payloads that are not trivially
+	// destructible, with both node allocator policies. Removed nodes
+	// are recycled by the pool.
+	AVLTree<std::string> pooled;
+	AVLTree<std::string, HeapAllocator> heap;
+	for(std::size_t i=0; i<2000; i++) {
+		std::string value = std::to_string(std::rand() % 300);
+		if (i % 3 == 2) {
+			pooled.remove(value);
+			heap.remove(value);
+		}
+		else {
+			pooled.push(value);
+			heap.push(value);
+		}
+	}
+	total_errors += pooled.check() + heap.check();
+	pooled.clear();
+	pooled.push("reused");
+
+	// Lookups against a sorted reference. String payloads are searched
+	// with C strings, without building std::string temporaries.
+	std::vector<int> ref;
+	AVLTree<int> lookup;
+	for(std::size_t i=0; i<1000; i++) {
+		int value = std::rand() % 2000;
+		ref.push_back(value);
+		lookup.push(value);
+	}
+	std::sort(ref.begin(), ref.end());
+
+	for(int key=-1; key<=2001; key++) {
+		auto lb = std::lower_bound(ref.begin(), ref.end(), key);
+		auto ub = std::upper_bound(ref.begin(), ref.end(), key);
+		const int *found = lookup.find(key);
+		const int *lower = lookup.lower_bound(key);
+		const int *upper = lookup.upper_bound(key);
+
+		total_errors += lookup.contains(key) != (lb != ub);
+		total_errors += (found != nullptr) && *found != key;
+		total_errors += (lb == ref.end()) ? lower != nullptr : (!lower || *lower != *lb);
+		total_errors += (ub == ref.end()) ? upper != nullptr : (!upper || *upper != *ub);
+	}
+
+	total_errors += !pooled.contains("reused") + pooled.contains("missing");
+	total_errors += (lookup.size() != 1000) + (pooled.size() != 1);
+
+	// Moves, in place construction and node handles: extracted nodes
+	// are relinked as is, so their element keeps its address.
+	AVLTree<std::string, HeapAllocator> source, target;
+	std::string moved = "moved";
+	source.push(std::move(moved)).emplace(3, 'x').push("a").push("b");
+	total_errors += !moved.empty() + !source.contains("xxx") + !source.contains("moved");
+
+	auto handle = source.extract("xxx");
+	const std::string *address = &handle.value();
+	target.insert(std::move(handle));
+	total_errors += bool(handle) + source.contains("xxx") + (target.find("xxx") != address);
+	total_errors += bool(source.extract("missing")) + (source.size() != 3) + (target.size() != 1);
+
+	auto renamed = pooled.extract("reused");
+	renamed.value() = "renamed";
+	address = &renamed.value();
+	pooled.insert(std::move(renamed));
+	total_errors += pooled.contains("reused") + (pooled.find("renamed") != address);
+
+	AVLTree<std::string> other_pool;
+	other_pool.insert(pooled.extract("renamed"));
+	total_errors += !other_pool.contains("renamed") + (pooled.size() != 0);
+
+	AVLTree<std::unique_ptr<int>> unique;
+	std::unique_ptr<int> owned(new int(1));
+	unique.push(std::move(owned)).emplace(new int(2)).remove(nullptr);
+	total_errors += (unique.size() != 2) + (owned != nullptr);
+
+	// Bulk load from the sorted reference, then from an unsorted range.
+	AVLTree<int> loaded(ref.begin(), ref.end());
+	total_errors += loaded.check();
+	for(int key: ref) {
+		total_errors += !loaded.contains(key);
+	}
+	std::vector<int> shuffled = {5, 3, 9, 1, 7};
+	loaded.assign(shuffled.begin(), shuffled.end(), false).push(4).remove(9);
+	total_errors += loaded.check() + loaded.contains(9) + !loaded.contains(4);
+
+	// Order statistics against the reference, under removals.
+	AVLTree<int, NodePool, true> ranked(ref.begin(), ref.end());
+	for(std::size_t i=0; i<200; i++) {
+		int key = std::rand() % 2000;
+		ranked.remove(key);
+		auto it = std::find(ref.begin(), ref.end(), key);
+		if (it != ref.end()) {
+			ref.erase(it);
+		}
+		ranked.push(i * 7);
+		ref.insert(std::upper_bound(ref.begin(), ref.end(), i * 7), i * 7);
+	}
+	total_errors += ranked.check() + (ranked.size() != ref.size()) + (ranked.select(ref.size()) != nullptr);
+	for(std::size_t k=0; k<ref.size(); k++) {
+		total_errors += *ranked.select(k) != ref[k];
+	}
+	for(int key=-1; key<=2001; key++) {
+		total_errors += ranked.rank(key) != std::size_t(std::lower_bound(ref.begin(), ref.end(), key) - ref.begin());
+	}
+
+	// Range visits, then expiry of everything up to a cutoff and of an
+	// inner range.
+	std::vector<int> visited;
+	ranked.visit_range(100, 900, [&visited](int value) {visited.push_back(value);});
+	total_errors += !std::equal(visited.begin(), visited.end(),
+	                            std::lower_bound(ref.begin(), ref.end(), 100),
+	                            std::upper_bound(ref.begin(), ref.end(), 900));
+
+	std::size_t expired = ranked.remove_range(-1, 250) + ranked.remove_range(600, 700);
+	auto expire = [&ref](int lo, int hi) {
+		ref.erase(std::lower_bound(ref.begin(), ref.end(), lo), std::upper_bound(ref.begin(), ref.end(), hi));
+	};
+	std::size_t before = ref.size();
+	expire(-1, 250);
+	expire(600, 700);
+	total_errors += ranked.check() + (ranked.size() != ref.size()) + (expired != before - ref.size());
+	for(std::size_t k=0; k<ref.size(); k++) {
+		total_errors += *ranked.select(k) != ref[k];
+	}
+
+	// Save, map and reload.
+	const char *saved = "avltree_test.bin";
+	ranked.save(saved);
+	{
+		MappedAVLFile<int> file(saved);
+		total_errors += !std::equal(file.begin(), file.end(), ref.begin(), ref.end());
+		for(int key=-1; key<=2001; key++) {
+			auto lb = std::lower_bound(ref.begin(), ref.end(), key);
+			const int *lower = file.lower_bound(key);
+			total_errors += file.contains(key) != std::binary_search(ref.begin(), ref.end(), key);
+			total_errors += (lb == ref.end()) ? lower != nullptr : (!lower || *lower != *lb);
+		}
+	}
+	AVLTree<int, NodePool, true> reloaded;
+	reloaded.push(-42).load(saved);
+	std::remove(saved);
+	total_errors += reloaded.check() + (reloaded.size() != ref.size()) + reloaded.contains(-42);
+	for(std::size_t k=0; k<ref.size(); k++) {
+		total_errors += *reloaded.select(k) != ref[k];
+	}
+
+	// Multiset mode: the keys pushed twice share their node with the
+	// bulk loaded ones, so the shape follows the distinct keys only.
+	AVLTree<int, NodePool, true, true> multi(ref.begin(), ref.end());
+	for(int key: ref) {
+		multi.push(key);
+	}
+	multi.remove(ref.front());
+	std::vector<int> doubled, distinct;
+	std::merge(ref.begin(), ref.end(), ref.begin(), ref.end(), std::back_inserter(doubled));
+	doubled.erase(doubled.begin());
+	std::unique_copy(ref.begin(), ref.end(), std::back_inserter(distinct));
+	total_errors += multi.check() + (multi.size() != doubled.size());
+	total_errors += multi.depth() != AVLTree<int>(distinct.begin(), distinct.end()).depth();
+	for(std::size_t k=0; k<doubled.size(); k++) {
+		total_errors += *multi.select(k) != doubled[k];
+	}
+
+	// Frozen copy, of the whole tree and of an empty one.
+	FrozenAVLTree<int> frozen_ranked = ranked.freeze();
+	total_errors += frozen_ranked.size() != ref.size();
+	for(int key=-1; key<=2001; key++) {
+		auto lb = std::lower_bound(ref.begin(), ref.end(), key);
+		auto ub = std::upper_bound(ref.begin(), ref.end(), key);
+		const int *lower = frozen_ranked.lower_bound(key);
+		const int *upper = frozen_ranked.upper_bound(key);
+		total_errors += frozen_ranked.contains(key) != (lb != ub);
+		total_errors += (lb == ref.end()) ? lower != nullptr : (!lower || *lower != *lb);
+		total_errors += (ub == ref.end()) ? upper != nullptr : (!upper || *upper != *ub);
+	}
+	total_errors += AVLTree<int>().freeze().lower_bound(0) != nullptr;
+
+	// Set operations, each checked against the std algorithms.
+	std::vector<int> a_keys, b_keys, expected;
+	for(std::size_t i=0; i<5000; i++) {
+		a_keys.push_back(std::rand() % 10000);
+		b_keys.push_back(std::rand() % 10000);
+	}
+	std::sort(a_keys.begin(), a_keys.end());
+	std::sort(b_keys.begin(), b_keys.end());
+	auto same = [&expected](const AVLTree<int, NodePool, true> &result) {
+		std::size_t errors = result.check() + (result.size() != expected.size());
+		for(std::size_t k=0; k<expected.size(); k++) {
+			errors += *result.select(k) != expected[k];
+		}
+		return errors;
+	};
+
+	for(int op=0; op<3; op++) {
+		AVLTree<int, NodePool, true> a(a_keys.begin(), a_keys.end());
+		AVLTree<int, NodePool, true> b(b_keys.begin(), b_keys.end());
+		expected.clear();
+		if (op == 0) {
+			a.unite(std::move(b));
+			std::merge(a_keys.begin(), a_keys.end(), b_keys.begin(), b_keys.end(), std::back_inserter(expected));
+		}
+		else {
+			// Elements of a with (without) an equivalent in b.
+			for(int key: a_keys) {
+				if (std::binary_search(b_keys.begin(), b_keys.end(), key) == (op == 1)) {
+					expected.push_back(key);
+				}
+			}
+			op == 1 ? a.intersect(std::move(b)) : a.subtract(std::move(b));
+		}
+		total_errors += same(a) + b.size();
+	}
+
+	AVLTree<int, NodePool, true> low(a_keys.begin(), a_keys.end());
+	AVLTree<int, NodePool, true> high;
+	high.push(10000).push(20000);
+	low.concat(std::move(high));
+	expected = a_keys;
+	expected.push_back(10000);
+	expected.push_back(20000);
+	total_errors += same(low);
+
+	// Batched insertion, unsorted batches of various sizes.
+	AVLTree<int, NodePool, true> batched(a_keys.begin(), a_keys.end());
+	std::vector<int> batch(b_keys);
+	std::shuffle(batch.begin(), batch.end(), std::mt19937(1));
+	for(std::size_t i=0, size=1; i<batch.size(); i+=size, size*=3) {
+		batched.push_batch(batch.begin() + i, batch.begin() + std::min(i + size, batch.size()));
+	}
+	expected.clear();
+	std::merge(a_keys.begin(), a_keys.end(), b_keys.begin(), b_keys.end(), std::back_inserter(expected));
+	total_errors += same(batched);
+
+	// Concurrent tree: same results as the reference when used from a
+	// single thread, then readers running along with writers on
+	// disjoint key ranges.
+	ConcurrentAVLTree<int> concurrent;
+	for(int key: ref) {
+		concurrent.push(key);
+	}
+	for(int key=0; key<2000; key+=5) {
+		while (concurrent.remove(key)) {}
+	}
+	ref.erase(std::remove_if(ref.begin(), ref.end(), [](int key) {return key % 5 == 0;}), ref.end());
+	for(int key=-1; key<=2001; key++) {
+		int lower = 0;
+		auto lb = std::lower_bound(ref.begin(), ref.end(), key);
+		total_errors += concurrent.contains(key) != std::binary_search(ref.begin(), ref.end(), key);
+		total_errors += concurrent.lower_bound(key, lower) != (lb != ref.end()) || (lb != ref.end() && lower != *lb);
+	}
+	total_errors += concurrent.check() + (concurrent.size() != ref.size());
+
+	std::atomic<bool> writing(true);
+	std::atomic<std::size_t> concurrent_errors(0);
+	std::vector<std::thread> writers, readers;
+	for(int w=0; w<2; w++) {
+		writers.emplace_back([&concurrent, w] {
+			for(int round=0; round<3; round++) {
+				for(int key=0; key<500; key++) concurrent.push(10000 * (w + 1) + key);
+				for(int key=0; key<500; key++) concurrent.remove(10000 * (w + 1) + key);
+			}
+		});
+	}
+	for(int r=0; r<2; r++) {
+		readers.emplace_back([&] {
+			while (writing) {
+				for(int key: ref) {
+					concurrent_errors += !concurrent.contains(key);
+				}
+			}
+		});
+	}
+	for(auto &writer: writers) writer.join();
+	writing = false;
+	for(auto &reader: readers) reader.join();
+	total_errors += concurrent_errors + concurrent.check() + (concurrent.size() != ref.size());
+
+	// Snapshots keep their content while the tree changes, and the
+	// tree keeps changing while snapshots are dropped.
+	PersistentAVLTree<int> persistent;
+	for(int key: ref) {
+		persistent.push(key);
+	}
+	PersistentAVLTree<int> frozen = persistent.snapshot();
+	for(int key=0; key<2000; key+=2) {
+		while (persistent.remove(key)) {}
+		persistent.push(key + 3000);
+	}
+	std::vector<int> snapshot_keys, persistent_keys;
+	frozen.visit([&snapshot_keys](int key) {snapshot_keys.push_back(key);});
+	{
+		PersistentAVLTree<int> dropped = persistent.snapshot();
+		dropped.push(-5);
+		persistent.remove(3000);
+	}
+	persistent.visit([&persistent_keys](int key) {persistent_keys.push_back(key);});
+	total_errors += snapshot_keys != ref;
+	total_errors += frozen.check() + persistent.check() + (persistent.size() != persistent_keys.size());
+	total_errors += persistent.contains(-5) + persistent.contains(3000) + !persistent.contains(3002);
+	for(int key: persistent_keys) {
+		total_errors += key < 2000 && key % 2 == 0;
+	}
+
+	// The compact layout must agree with the reference, before and
+	// after renumbering its nodes.
+	CompactAVLTree<int> compact;
+	for(int key: ref) {
+		compact.push(key);
+	}
+	for(int key=0; key<2000; key+=3) {
+		while (compact.contains(key)) {
+			compact.remove(key);
+		}
+		ref.erase(std::remove(ref.begin(), ref.end(), key), ref.end());
+		total_errors += compact.check();
+	}
+	compact.relayout();
+	for(int key=-1; key<=2001; key++) {
+		auto lb = std::lower_bound(ref.begin(), ref.end(), key);
+		const int *lower = compact.lower_bound(key);
+		total_errors += compact.contains(key) != std::binary_search(ref.begin(), ref.end(), key);
+		total_errors += (lb == ref.end()) ? lower != nullptr : (!lower || *lower != *lb);
+	}
 
 	return total_errors;
 }
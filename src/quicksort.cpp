@@ -5,6 +5,9 @@
 #include <cstdlib>
 #include <ctime>
 #include <cstdint>
+#include <chrono>
+#include <string>
+#include <utility>
 
 template<typename T>
 std::ostream &operator<<(std::ostream &os, const std::vector<T> &vector) {
@@ -29,33 +32,150 @@ bool check(const std::vector<T> &array, const std::vector<T> &ref) {
 template<typename T>
 inline void swap(std::vector<T> &array, size_t indexA, size_t indexB) {
 	if (indexA != indexB) {
-		T tmp;
-		tmp = array[indexA];
-		array[indexA] = array[indexB];
-		array[indexB] = tmp;
+		std::swap(array[indexA], array[indexB]);
 	}
 }
 
-template<typename T>
-void quicksort_base(std::vector<T> &array, int64_t start, int64_t last) {
-	if (start >= last) return;
+/**
+ * Ranges of at most this many elements are left to insertion sort.
+ */
+static const int64_t insertion_cutoff = 24;
 
-	int64_t pivot = start + std::rand() % (last-start+1);
+/**
+ * Ranges of more than this many elements take their pivot with a
+ * ninther instead of a median of 3.
+ */
+static const int64_t ninther_threshold = 128;
 
-	swap(array, pivot, last);
+/**
+ * Insertion sort of [start, last], fastest on small ranges.
+ */
+template<typename T>
+void insertion_sort(std::vector<T> &array, int64_t start, int64_t last) {
+	for(int64_t i=start+1; i<=last; i++) {
+		T value = std::move(array[i]);
+		int64_t j = i;
+		for(; j>start && value < array[j-1]; j--) {
+			array[j] = std::move(array[j-1]);
+		}
+		array[j] = std::move(value);
+	}
+}
 
-	int64_t j=start;
-	for(int64_t i=start; i<last; i++) {
-		if(array[i] <= array[last]) {
-			swap(array, i, j);
-			j++;
+/**
+ * Move the element at index down the max-heap of count elements
+ * starting at start, until it is not less than its children.
+ */
+template<typename T>
+void sift_down(std::vector<T> &array, int64_t start, int64_t count, int64_t index) {
+	T value = std::move(array[start+index]);
+	for(int64_t child=2*index+1; child<count; child=2*index+1) {
+		if (child+1 < count && array[start+child] < array[start+child+1]) {
+			child++;
 		}
+		if (!(value < array[start+child])) break;
+		array[start+index] = std::move(array[start+child]);
+		index = child;
+	}
+	array[start+index] = std::move(value);
+}
+
+/**
+ * Heap sort of [start, last]: O(n log n) whatever the input, the
+ * fallback when quick sort recurses too deep.
+ */
+template<typename T>
+void heapsort(std::vector<T> &array, int64_t start, int64_t last) {
+	int64_t count = last-start+1;
+	for(int64_t i=count/2-1; i>=0; i--) {
+		sift_down(array, start, count, i);
+	}
+	for(int64_t end=count-1; end>0; end--) {
+		swap(array, start, start+end);
+		sift_down(array, start, end, 0);
+	}
+}
+
+/**
+ * Return the index of the median of the elements at a, b and c.
+ */
+template<typename T>
+int64_t median_of_3(const std::vector<T> &array, int64_t a, int64_t b, int64_t c) {
+	if (array[a] < array[b]) {
+		if (array[b] < array[c]) return b;
+		return array[a] < array[c] ? c : a;
+	}
+	if (array[a] < array[c]) return a;
+	return array[b] < array[c] ? c : b;
+}
+
+/**
+ * Return the index of the pivot of [start, last]: the median of the
+ * first, middle and last elements, or for large ranges the median of
+ * the medians of three such triplets (Tukey's ninther). Sorted and
+ * reversed inputs thus get a pivot in the middle.
+ */
+template<typename T>
+int64_t choose_pivot(const std::vector<T> &array, int64_t start, int64_t last) {
+	int64_t middle = start + (last-start)/2;
+	if (last-start+1 <= ninther_threshold) {
+		return median_of_3(array, start, middle, last);
 	}
 
-	swap(array, last, j);
+	int64_t step = (last-start+1)/8;
+	return median_of_3(array,
+	                   median_of_3(array, start, start+step, start+2*step),
+	                   median_of_3(array, middle-step, middle, middle+step),
+	                   median_of_3(array, last-2*step, last-step, last));
+}
+
+/**
+ * Introsort of [start, last].
+ *
+ * The range is split in three by a Dutch flag partition: elements less
+ * than the pivot, equal to it and greater than it. The equal ones are
+ * in place, so many equal keys make the ranges shrink faster instead of
+ * degenerating to O(n^2). Only the smaller side is sorted by a
+ * recursive call, the larger one by the loop, which bounds the stack to
+ * O(log n). Once depth_limit partitions have been done, the range is
+ * heap sorted, and small ranges are insertion sorted.
+ */
+template<typename T>
+void quicksort_base(std::vector<T> &array, int64_t start, int64_t last, int depth_limit) {
+	while (last-start+1 > insertion_cutoff) {
+		if (depth_limit-- == 0) {
+			heapsort(array, start, last);
+			return;
+		}
+
+		T pivot = array[choose_pivot(array, start, last)];
 
-	quicksort_base(array, start, j-1);
-	quicksort_base(array, j+1, last);
+		// [start, lower) < pivot, [lower, i) == pivot,
+		// [i, upper] not yet seen, (upper, last] > pivot.
+		int64_t lower = start, i = start, upper = last;
+		while (i <= upper) {
+			if (array[i] < pivot) {
+				swap(array, lower++, i++);
+			}
+			else if (pivot < array[i]) {
+				swap(array, i, upper--);
+			}
+			else {
+				i++;
+			}
+		}
+
+		if (lower-start < last-upper) {
+			quicksort_base(array, start, lower-1, depth_limit);
+			start = upper+1;
+		}
+		else {
+			quicksort_base(array, upper+1, last, depth_limit);
+			last = lower-1;
+		}
+	}
+
+	insertion_sort(array, start, last);
 }
 
 /**
@@ -63,12 +183,59 @@ void quicksort_base(std::vector<T> &array, int64_t start, int64_t last) {
  */
 template<typename T>
 void quicksort(std::vector<T> &array) {
-	quicksort_base(array, 0, array.size()-1);
+	if (array.size() < 2) return;
+
+	// 2 log2(n) partitions before falling back to heap sort.
+	int depth_limit = 0;
+	for(std::size_t size=array.size(); size>1; size/=2) {
+		depth_limit += 2;
+	}
+
+	quicksort_base(array, 0, array.size()-1, depth_limit);
+}
+
+/**
+ * Sort count ints with quicksort and std::sort, on sorted, reversed,
+ * all equal, few distinct and random inputs.
+ */
+void bench(std::size_t count) {
+	std::vector<std::pair<const char *, std::vector<int>>> inputs;
+	std::vector<int> input(count);
+	for(std::size_t i=0; i<count; i++) input[i] = int(i);
+	inputs.emplace_back("sorted      ", input);
+	std::reverse(input.begin(), input.end());
+	inputs.emplace_back("reversed    ", input);
+	std::fill(input.begin(), input.end(), 42);
+	inputs.emplace_back("all equal   ", input);
+	for(std::size_t i=0; i<count; i++) input[i] = std::rand() % 16;
+	inputs.emplace_back("16 distinct ", input);
+	for(std::size_t i=0; i<count; i++) input[i] = std::rand();
+	inputs.emplace_back("random      ", input);
+
+	auto measure = [](std::vector<int> array, void (*sort)(std::vector<int> &)) {
+		auto start = std::chrono::steady_clock::now();
+		sort(array);
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		return elapsed.count();
+	};
+
+	std::cout << "sort benchmark, " << count << " ints" << std::endl;
+	for(const auto &named: inputs) {
+		double quicksort_time = measure(named.second, quicksort<int>);
+		double std_time = measure(named.second, [](std::vector<int> &array) {std::sort(array.begin(), array.end());});
+		std::cout << "  " << named.first << " quicksort " << quicksort_time
+		          << " s, std::sort " << std_time << " s" << std::endl;
+	}
 }
 
-int main(void) {
+int main(int argc, char **argv) {
 	std::srand(std::time(0));
 
+	if (argc > 1 && std::string(argv[1]) == "bench") {
+		bench(argc > 2 ? std::stoul(argv[2]) : 10000000);
+		return 0;
+	}
+
 	std::vector<int> array = {-5, 5, -14, 13, 10, 8, -1, 10, -12, 7, 0, 9, 2, 14, -14, -15, -13};
 	std::vector<int> sorted = array;
 	std::vector<int> sorted_ref = array;
@@ -81,5 +248,38 @@ int main(void) {
 	std::cout << "Sorted:     " << sorted << std::endl;
 	std::cout << "Sorted ref: " << sorted_ref << std::endl;
 
-	return check(sorted, sorted_ref) ? 0 : 1;
+	// Sizes around the insertion cutoff and the ninther threshold, and
+	// large inputs of each kind.
+	bool ok = check(sorted, sorted_ref);
+	for(std::size_t size: {0, 1, 2, 23, 24, 25, 128, 129, 1000, 100000}) {
+		for(int kind=0; kind<5; kind++) {
+			std::vector<int> input(size);
+			for(std::size_t i=0; i<size; i++) {
+				int values[] = {int(i), int(size-i), 7, std::rand() % 3, std::rand()};
+				input[i] = values[kind];
+			}
+			std::vector<int> ref = input;
+			std::sort(ref.begin(), ref.end());
+			quicksort(input);
+			ok = ok && check(input, ref);
+		}
+	}
+
+	// The heap sort fallback on its own.
+	std::vector<int> heap = array;
+	heapsort(heap, 0, heap.size()-1);
+	ok = ok && check(heap, sorted_ref);
+
+	// Partitions falling back to the heap sort after one level.
+	std::vector<int> shallow(100000);
+	for(std::size_t i=0; i<shallow.size(); i++) {
+		shallow[i] = std::rand();
+	}
+	std::vector<int> shallow_ref = shallow;
+	std::sort(shallow_ref.begin(), shallow_ref.end());
+	quicksort_base(shallow, 0, shallow.size()-1, 1);
+	ok = ok && check(shallow, shallow_ref);
+
+	std::cout << (ok ? "OK" : "FAILED") << std::endl;
+	return ok ? 0 : 1;
 }
@@ -1,200 +1,3241 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cmath>
 #include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <typeinfo>
 #include <utility>
+#include <cxxabi.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
+/**
+ * Allocator policies
+ *
+ * A Vector allocates raw bytes from its allocator, which is stored in
+ * the vector and copied along with it:
+ * - allocate(bytes) returns an uninitialized block aligned on
+ *   alignment (or nullptr for 0 bytes) and throws std::bad_alloc on
+ *   failure;
+ * - deallocate(block, bytes) gives back a block of the given size;
+ * - reallocate(block, old_bytes, bytes) grows a block, keeping its
+ *   content byte for byte. Only used for trivially relocatable types.
+ */
+
+/**
+ * The default allocator: malloc, realloc and free. Large blocks are
+ * mmap'ed by glibc and grown with mremap, without copying the content.
+ */
+struct MallocAllocator
+{
+	static constexpr std::size_t alignment = alignof(std::max_align_t);
+
+	void *allocate(std::size_t bytes)
+	{
+		void *block = std::malloc(bytes);
+		if(!block && bytes) {
+			throw std::bad_alloc();
+		}
+		return block;
+	}
+
+	void deallocate(void *block, std::size_t)
+	{
+		std::free(block);
+	}
+
+	void *reallocate(void *block, std::size_t, std::size_t bytes)
+	{
+		block = std::realloc(block, bytes);
+		if(!block) {
+			throw std::bad_alloc();
+		}
+		return block;
+	}
+};
+
+/**
+ * Blocks aligned on Align bytes (a cache line by default), for SIMD
+ * loads and to avoid false sharing between vectors.
+ *
+ * realloc does not keep the alignment, so small blocks come from
+ * posix_memalign and are copied when they grow. Blocks of map_threshold
+ * bytes or more are anonymous mappings, page aligned, and grow with
+ * mremap without copying, like large malloc blocks do.
+ */
+template<std::size_t Align = 64>
+struct AlignedAllocator
+{
+	static_assert(Align >= sizeof(void *) && (Align & (Align - 1)) == 0,
+	              "the alignment must be a power of two multiple of sizeof(void *)");
+	static constexpr std::size_t alignment = Align;
+	static constexpr std::size_t page = 4096;
+	static constexpr std::size_t map_threshold = Align <= page ? 1 << 20 : ~std::size_t(0);
+
+	static std::size_t round(std::size_t bytes)
+	{
+		return (bytes + page - 1) & ~(page - 1);
+	}
+
+	void *allocate(std::size_t bytes)
+	{
+		void *block = nullptr;
+		if(bytes >= map_threshold) {
+			block = mmap(nullptr, round(bytes), PROT_READ | PROT_WRITE,
+			             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if(block == MAP_FAILED) {
+				throw std::bad_alloc();
+			}
+		}
+		else if(bytes && posix_memalign(&block, Align, bytes) != 0) {
+			throw std::bad_alloc();
+		}
+		return block;
+	}
+
+	void deallocate(void *block, std::size_t bytes)
+	{
+		if(bytes >= map_threshold) {
+			munmap(block, round(bytes));
+		}
+		else {
+			std::free(block);
+		}
+	}
+
+	void *reallocate(void *block, std::size_t old_bytes, std::size_t bytes)
+	{
+		if(block && old_bytes >= map_threshold && bytes >= map_threshold) {
+			void *grown = mremap(block, round(old_bytes), round(bytes), MREMAP_MAYMOVE);
+			if(grown == MAP_FAILED) {
+				throw std::bad_alloc();
+			}
+			return grown;
+		}
+
+		void *grown = allocate(bytes);
+		if(block) {
+			std::memcpy(grown, block, std::min(old_bytes, bytes));
+		}
+		deallocate(block, old_bytes);
+		return grown;
+	}
+};
+
+/**
+ * Anonymous mappings rounded to 2 MiB and advised to be backed by
+ * transparent huge pages, which cuts TLB misses on large vectors.
+ * Blocks are grown with mremap. Small vectors waste most of their
+ * mapping, so this is for vectors of several MiB.
+ */
+struct HugePageAllocator
+{
+	static constexpr std::size_t alignment = 4096;
+	static constexpr std::size_t huge_page = 2 << 20;
+
+	static std::size_t round(std::size_t bytes)
+	{
+		return (bytes + huge_page - 1) & ~(huge_page - 1);
+	}
+
+	void *allocate(std::size_t bytes)
+	{
+		if(!bytes) {
+			return nullptr;
+		}
+
+		void *block = mmap(nullptr, round(bytes), PROT_READ | PROT_WRITE,
+		                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(block == MAP_FAILED) {
+			throw std::bad_alloc();
+		}
+		madvise(block, round(bytes), MADV_HUGEPAGE);
+		return block;
+	}
+
+	void deallocate(void *block, std::size_t bytes)
+	{
+		if(block) {
+			munmap(block, round(bytes));
+		}
+	}
+
+	void *reallocate(void *block, std::size_t old_bytes, std::size_t bytes)
+	{
+		if(!block) {
+			return allocate(bytes);
+		}
+		if(round(bytes) == round(old_bytes)) {
+			return block;
+		}
+
+		block = mremap(block, round(old_bytes), round(bytes), MREMAP_MAYMOVE);
+		if(block == MAP_FAILED) {
+			throw std::bad_alloc();
+		}
+		madvise(block, round(bytes), MADV_HUGEPAGE);
+		return block;
+	}
+};
+
+/**
+ * Memory region handing out blocks by bumping a pointer in large
+ * chunks. Blocks are never freed one by one: the whole arena is
+ * released at once when destroyed, so it must outlive its vectors.
+ */
+class Arena
+{
+public:
+	static constexpr std::size_t alignment = alignof(std::max_align_t);
+
+	Arena(std::size_t chunk_size = 1 << 20):
+		m_chunk_size(chunk_size),
+		m_chunk(nullptr),
+		m_top(nullptr),
+		m_end(nullptr)
+	{
+	}
+
+	Arena(const Arena &) = delete;
+	Arena &operator=(const Arena &) = delete;
+
+	~Arena()
+	{
+		while(m_chunk) {
+			Chunk *next = m_chunk->next;
+			std::free(m_chunk);
+			m_chunk = next;
+		}
+	}
+
+	void *allocate(std::size_t bytes)
+	{
+		bytes = round(bytes);
+		if(bytes > std::size_t(m_end - m_top)) {
+			std::size_t size = std::max(m_chunk_size, bytes + round(sizeof(Chunk)));
+			Chunk *chunk = static_cast<Chunk *>(std::malloc(size));
+			if(!chunk) {
+				throw std::bad_alloc();
+			}
+			chunk->next = m_chunk;
+			m_chunk = chunk;
+			m_top = reinterpret_cast<char *>(chunk) + round(sizeof(Chunk));
+			m_end = reinterpret_cast<char *>(chunk) + size;
+		}
+
+		char *block = m_top;
+		m_top += bytes;
+		return block;
+	}
+
+	/**
+	 * Grow the block in place when it is the last one handed out and
+	 * the chunk has room left, copy it otherwise.
+	 */
+	void *reallocate(void *block, std::size_t old_bytes, std::size_t bytes)
+	{
+		char *start = static_cast<char *>(block);
+		if(block && start + round(old_bytes) == m_top &&
+		   round(bytes) <= std::size_t(m_end - start)) {
+			m_top = start + round(bytes);
+			return block;
+		}
+
+		void *grown = allocate(bytes);
+		if(block) {
+			std::memcpy(grown, block, std::min(old_bytes, bytes));
+		}
+		return grown;
+	}
+
+private:
+	struct Chunk
+	{
+		Chunk *next;
+	};
+
+	static std::size_t round(std::size_t bytes)
+	{
+		return (bytes + alignment - 1) & ~(alignment - 1);
+	}
+
+	std::size_t m_chunk_size;
+	Chunk *m_chunk;
+	char *m_top;
+	char *m_end;
+};
+
+/**
+ * Allocator policy drawing from an Arena. It has no default
+ * constructor: the vector must be given the allocator of its arena.
+ */
+class ArenaAllocator
+{
+public:
+	static constexpr std::size_t alignment = Arena::alignment;
+
+	ArenaAllocator(Arena &arena):
+		m_arena(&arena)
+	{
+	}
+
+	void *allocate(std::size_t bytes)
+	{
+		return bytes ? m_arena->allocate(bytes) : nullptr;
+	}
+
+	void deallocate(void *, std::size_t)
+	{
+	}
+
+	void *reallocate(void *block, std::size_t old_bytes, std::size_t bytes)
+	{
+		return m_arena->reallocate(block, old_bytes, bytes);
+	}
+
+private:
+	Arena *m_arena;
+};
+
+
+/**
+ * Allocator used by default for T: cache line aligned blocks for
+ * arithmetic types, so that SIMD kernels work on aligned data, blocks
+ * aligned for T when it is over-aligned, malloc otherwise.
+ */
+template<typename T>
+struct DefaultAllocator
+{
+	static constexpr std::size_t align = std::is_arithmetic<T>::value && alignof(T) < 64 ? 64 : alignof(T);
+
+	typedef typename std::conditional<std::is_arithmetic<T>::value || (alignof(T) > MallocAllocator::alignment),
+	                                  AlignedAllocator<align>, MallocAllocator>::type type;
+};
+
+
+/**
+ * Growth policies
+ *
+ * next(capacity) returns the capacity to reserve when a full vector
+ * of the given capacity receives a new element.
+ */
+
+/**
+ * Multiply the capacity by Num / Den (at least one more element). A
+ * factor of 2 gives the fewest reallocations, 1.5 lets a block reuse
+ * the memory freed by the previous ones.
+ */
+template<std::size_t Num, std::size_t Den>
+struct GeometricGrowth
+{
+	static_assert(Num > Den, "the growth factor must be greater than one");
+
+	static std::size_t next(std::size_t capacity)
+	{
+		return std::max(capacity + 1, capacity / Den * Num + capacity % Den * Num / Den);
+	}
+};
+
+typedef GeometricGrowth<2, 1> DoublingGrowth;
+typedef GeometricGrowth<3, 2> HalfGrowth;
+
+/**
+ * Add Chunk elements at each reallocation: memory overhead is bounded
+ * but pushing n elements costs O(n^2 / Chunk) copies, unless the
+ * allocator grows blocks in place.
+ */
+template<std::size_t Chunk>
+struct ChunkGrowth
+{
+	static_assert(Chunk > 0, "the chunk must not be empty");
+
+	static std::size_t next(std::size_t capacity)
+	{
+		return capacity + Chunk;
+	}
+};
+
+
+/**
+ * Tell if objects of type T can be moved to another address with a
+ * plain byte copy, the source being then simply forgotten (never
+ * destroyed). True for trivially copyable types; specialize it for
+ * other types known to be safe.
+ */
+template<typename T>
+struct is_trivially_relocatable: std::is_trivially_copyable<T> {};
+
+/**
+ * Relocation engine used when a vector grows: relocate moves count
+ * elements from the block old of old_capacity elements to a new block
+ * of capacity elements taken from alloc, gives old back and returns
+ * the new block.
+ *
+ * Generic case: each element is move constructed in the new block, or
+ * copy constructed when its move constructor may throw, so that an
+ * exception leaves the old block untouched. The old elements are only
+ * destroyed once all of them have been relocated.
+ */
+template<typename T, bool Trivial = is_trivially_relocatable<T>::value>
+struct Relocator
+{
+	/**
+	 * Move count elements from src to the uninitialized memory dst and
+	 * destroy them in src. If a copy throws, the elements already built
+	 * in dst are destroyed and src is left untouched.
+	 */
+	static void move(char *dst, char *src, std::size_t count)
+	{
+		T* from = reinterpret_cast<T*>(src);
+		T* to = reinterpret_cast<T*>(dst);
+		std::size_t i = 0;
+		try {
+			for(; i<count; ++i) {
+				new (to+i) T(std::move_if_noexcept(from[i]));
+			}
+		}
+		catch(...) {
+			while(i > 0) {
+				to[--i].~T();
+			}
+			throw;
+		}
+
+		for(i=0; i<count; ++i) {
+			from[i].~T();
+		}
+	}
+
+	template<typename Alloc>
+	static char *relocate(Alloc &alloc, char *old, std::size_t count,
+	                      std::size_t old_capacity, std::size_t capacity)
+	{
+		char *array = static_cast<char *>(alloc.allocate(capacity*sizeof(T)));
+		try {
+			move(array, old, count);
+		}
+		catch(...) {
+			alloc.deallocate(array, capacity*sizeof(T));
+			throw;
+		}
+		alloc.deallocate(old, old_capacity*sizeof(T));
+		return array;
+	}
+};
+
+/**
+ * Trivially relocatable case: elements are moved with memcpy, and a
+ * whole block is handed to the allocator's reallocate. With malloc,
+ * realloc grows it in place when the following memory is free and
+ * copies the bytes otherwise. Large blocks are mmap'ed by glibc and
+ * grown with mremap, which only remaps the pages: a vector of several
+ * GB grows without its content being copied.
+ */
+template<typename T>
+struct Relocator<T, true>
+{
+	static void move(char *dst, char *src, std::size_t count)
+	{
+		if(count) {
+			std::memcpy(dst, src, count*sizeof(T));
+		}
+	}
+
+	template<typename Alloc>
+	static char *relocate(Alloc &alloc, char *old, std::size_t,
+	                      std::size_t old_capacity, std::size_t capacity)
+	{
+		return static_cast<char *>(alloc.reallocate(old, old_capacity*sizeof(T), capacity*sizeof(T)));
+	}
+};
+
+
+/**
+ * SIMD kernels
+ *
+ * The bulk operations of Vector on arithmetic types are written once
+ * with the GCC vector extensions, on packs of Bytes bytes, and
+ * instantiated for each instruction set: SSE2 (16 bytes, always
+ * available on x86-64), AVX2 (32 bytes) and AVX-512 (64 bytes), each in
+ * functions compiled with the matching target attribute. The widest
+ * one supported by the CPU is picked at runtime. Other types (bool,
+ * long double) and other architectures use the scalar kernels.
+ */
+
+/**
+ * Tell if the kernels can process T with vector packs.
+ */
+template<typename T>
+struct is_simd_type: std::integral_constant<bool,
+	std::is_arithmetic<T>::value && !std::is_same<T, bool>::value && !std::is_same<T, long double>::value> {};
+
+enum class SimdIsa {scalar, sse2, avx2, avx512};
+
+/**
+ * Instruction set used by the kernels: the best one supported, unless
+ * another one was forced with simd_force.
+ */
+inline SimdIsa &simd_isa_storage()
+{
+	static SimdIsa isa = [] {
+#if defined(__x86_64__)
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx512f")) {
+			return SimdIsa::avx512;
+		}
+		if(__builtin_cpu_supports("avx2")) {
+			return SimdIsa::avx2;
+		}
+		return SimdIsa::sse2;
+#else
+		return SimdIsa::scalar;
+#endif
+	}();
+	return isa;
+}
+
+inline SimdIsa simd_isa()
+{
+	return simd_isa_storage();
+}
+
+/**
+ * Use the given instruction set, which must be supported by the CPU
+ * (tests and benchmarks compare them).
+ */
+inline void simd_force(SimdIsa isa)
+{
+	simd_isa_storage() = isa;
+}
+
+/**
+ * Scalar kernels, the reference for all the others. Empty ranges give
+ * the neutral element: 0 for sum and dot, the largest value for min and
+ * the lowest one for max. find returns count when value is not found.
+ */
+struct ScalarKernels
+{
+	template<typename T>
+	static T min_neutral()
+	{
+		return std::numeric_limits<T>::has_infinity ? std::numeric_limits<T>::infinity() : std::numeric_limits<T>::max();
+	}
+
+	template<typename T>
+	static T max_neutral()
+	{
+		return std::numeric_limits<T>::has_infinity ? -std::numeric_limits<T>::infinity() : std::numeric_limits<T>::lowest();
+	}
+
+	template<typename T>
+	static void fill(T *dst, std::size_t count, T value)
+	{
+		for(std::size_t i=0; i<count; i++) {
+			dst[i] = value;
+		}
+	}
+
+	template<typename T, typename F>
+	static void transform(T *dst, std::size_t count, F f)
+	{
+		for(std::size_t i=0; i<count; i++) {
+			dst[i] = f(dst[i]);
+		}
+	}
+
+	template<typename T>
+	static T sum(const T *src, std::size_t count)
+	{
+		T total = 0;
+		for(std::size_t i=0; i<count; i++) {
+			total += src[i];
+		}
+		return total;
+	}
+
+	template<typename T>
+	static T min(const T *src, std::size_t count)
+	{
+		T result = min_neutral<T>();
+		for(std::size_t i=0; i<count; i++) {
+			result = src[i] < result ? src[i] : result;
+		}
+		return result;
+	}
+
+	template<typename T>
+	static T max(const T *src, std::size_t count)
+	{
+		T result = max_neutral<T>();
+		for(std::size_t i=0; i<count; i++) {
+			result = src[i] > result ? src[i] : result;
+		}
+		return result;
+	}
+
+	template<typename T>
+	static T dot(const T *a, const T *b, std::size_t count)
+	{
+		T total = 0;
+		for(std::size_t i=0; i<count; i++) {
+			total += a[i] * b[i];
+		}
+		return total;
+	}
+
+	template<typename T>
+	static std::size_t find(const T *src, std::size_t count, T value)
+	{
+		std::size_t i = 0;
+		while(i < count && !(src[i] == value)) {
+			i++;
+		}
+		return i;
+	}
+};
+
+/**
+ * Kernels on packs of Bytes bytes. They are always inlined in the
+ * functions of the instruction set structures below, so the packs are
+ * compiled with the target of those functions, and never cross a
+ * function call. The reductions keep 4 accumulators to hide the
+ * latency of the additions; floating point sums are thus not computed
+ * in the same order as the scalar ones. Loads and stores go through
+ * memcpy, which compiles to unaligned moves: as fast as aligned ones on
+ * aligned data, and the kernels still work on any pointer.
+ */
+template<typename T, std::size_t Bytes>
+struct SimdKernels
+{
+	static constexpr std::size_t lanes = Bytes / sizeof(T);
+	typedef T Pack __attribute__((vector_size(Bytes)));
+
+	__attribute__((always_inline)) static inline void fill(T *dst, std::size_t count, T value)
+	{
+		Pack pack = Pack{} + value;
+		std::size_t i = 0;
+		for(; i + lanes <= count; i += lanes) {
+			std::memcpy(dst + i, &pack, Bytes);
+		}
+		ScalarKernels::fill(dst + i, count - i, value);
+	}
+
+	template<typename F>
+	__attribute__((always_inline)) static inline void transform(T *dst, std::size_t count, F f)
+	{
+		std::size_t i = 0;
+		for(; i + lanes <= count; i += lanes) {
+			Pack pack;
+			std::memcpy(&pack, dst + i, Bytes);
+			pack = f(pack);
+			std::memcpy(dst + i, &pack, Bytes);
+		}
+		ScalarKernels::transform(dst + i, count - i, f);
+	}
+
+	__attribute__((always_inline)) static inline T sum(const T *src, std::size_t count)
+	{
+		Pack total[4] = {};
+		std::size_t i = 0;
+		for(; i + 4 * lanes <= count; i += 4 * lanes) {
+			for(std::size_t k=0; k<4; k++) {
+				Pack pack;
+				std::memcpy(&pack, src + i + k * lanes, Bytes);
+				total[k] += pack;
+			}
+		}
+		for(; i + lanes <= count; i += lanes) {
+			Pack pack;
+			std::memcpy(&pack, src + i, Bytes);
+			total[0] += pack;
+		}
+		total[0] += total[1] + total[2] + total[3];
+
+		T result = ScalarKernels::sum(src + i, count - i);
+		for(std::size_t lane=0; lane<lanes; lane++) {
+			result += total[0][lane];
+		}
+		return result;
+	}
+
+	__attribute__((always_inline)) static inline T min(const T *src, std::size_t count)
+	{
+		Pack result = Pack{} + ScalarKernels::min_neutral<T>();
+		std::size_t i = 0;
+		for(; i + lanes <= count; i += lanes) {
+			Pack pack;
+			std::memcpy(&pack, src + i, Bytes);
+			result = pack < result ? pack : result;
+		}
+
+		T value = ScalarKernels::min(src + i, count - i);
+		for(std::size_t lane=0; lane<lanes; lane++) {
+			value = result[lane] < value ? result[lane] : value;
+		}
+		return value;
+	}
+
+	__attribute__((always_inline)) static inline T max(const T *src, std::size_t count)
+	{
+		Pack result = Pack{} + ScalarKernels::max_neutral<T>();
+		std::size_t i = 0;
+		for(; i + lanes <= count; i += lanes) {
+			Pack pack;
+			std::memcpy(&pack, src + i, Bytes);
+			result = pack > result ? pack : result;
+		}
+
+		T value = ScalarKernels::max(src + i, count - i);
+		for(std::size_t lane=0; lane<lanes; lane++) {
+			value = result[lane] > value ? result[lane] : value;
+		}
+		return value;
+	}
+
+	__attribute__((always_inline)) static inline T dot(const T *a, const T *b, std::size_t count)
+	{
+		Pack total[4] = {};
+		std::size_t i = 0;
+		for(; i + 4 * lanes <= count; i += 4 * lanes) {
+			for(std::size_t k=0; k<4; k++) {
+				Pack pack_a, pack_b;
+				std::memcpy(&pack_a, a + i + k * lanes, Bytes);
+				std::memcpy(&pack_b, b + i + k * lanes, Bytes);
+				total[k] += pack_a * pack_b;
+			}
+		}
+		for(; i + lanes <= count; i += lanes) {
+			Pack pack_a, pack_b;
+			std::memcpy(&pack_a, a + i, Bytes);
+			std::memcpy(&pack_b, b + i, Bytes);
+			total[0] += pack_a * pack_b;
+		}
+		total[0] += total[1] + total[2] + total[3];
+
+		T result = ScalarKernels::dot(a + i, b + i, count - i);
+		for(std::size_t lane=0; lane<lanes; lane++) {
+			result += total[0][lane];
+		}
+		return result;
+	}
+
+	__attribute__((always_inline)) static inline std::size_t find(const T *src, std::size_t count, T value)
+	{
+		Pack needle = Pack{} + value;
+		std::size_t i = 0;
+		for(; i + lanes <= count; i += lanes) {
+			Pack pack;
+			std::memcpy(&pack, src + i, Bytes);
+			auto equal = pack == needle;
+
+			// The comparison gives -1 in matching lanes and 0 in the
+			// others: OR the pack as 64 bit words to test them all.
+			std::uint64_t words[Bytes / 8], any = 0;
+			std::memcpy(words, &equal, Bytes);
+			for(std::size_t w=0; w<Bytes / 8; w++) {
+				any |= words[w];
+			}
+			if(any) {
+				break;
+			}
+		}
+		return i + ScalarKernels::find(src + i, count - i, value);
+	}
+};
+
+struct Sse2Kernels
+{
+	static constexpr std::size_t bytes = 16;
+
+	template<typename T>
+	static void fill(T *dst, std::size_t count, T value)
+	{
+		SimdKernels<T, bytes>::fill(dst, count, value);
+	}
+
+	/**
+	 * The functor is compiled for the baseline instruction set, so
+	 * only SSE2 packs may be handed to it: transform never uses wider
+	 * ones.
+	 */
+	template<typename T, typename F>
+	static void transform(T *dst, std::size_t count, F f)
+	{
+		SimdKernels<T, bytes>::transform(dst, count, f);
+	}
+
+	template<typename T>
+	static T sum(const T *src, std::size_t count)
+	{
+		return SimdKernels<T, bytes>::sum(src, count);
+	}
+
+	template<typename T>
+	static T min(const T *src, std::size_t count)
+	{
+		return SimdKernels<T, bytes>::min(src, count);
+	}
+
+	template<typename T>
+	static T max(const T *src, std::size_t count)
+	{
+		return SimdKernels<T, bytes>::max(src, count);
+	}
+
+	template<typename T>
+	static T dot(const T *a, const T *b, std::size_t count)
+	{
+		return SimdKernels<T, bytes>::dot(a, b, count);
+	}
+
+	template<typename T>
+	static std::size_t find(const T *src, std::size_t count, T value)
+	{
+		return SimdKernels<T, bytes>::find(src, count, value);
+	}
+};
+
+#if defined(__x86_64__)
+struct Avx2Kernels: Sse2Kernels
+{
+	static constexpr std::size_t bytes = 32;
+
+	template<typename T>
+	__attribute__((target("avx2"))) static void fill(T *dst, std::size_t count, T value)
+	{
+		SimdKernels<T, bytes>::fill(dst, count, value);
+	}
+
+	template<typename T>
+	__attribute__((target("avx2"))) static T sum(const T *src, std::size_t count)
+	{
+		return SimdKernels<T, bytes>::sum(src, count);
+	}
+
+	template<typename T>
+	__attribute__((target("avx2"))) static T min(const T *src, std::size_t count)
+	{
+		return SimdKernels<T, bytes>::min(src, count);
+	}
+
+	template<typename T>
+	__attribute__((target("avx2"))) static T max(const T *src, std::size_t count)
+	{
+		return SimdKernels<T, bytes>::max(src, count);
+	}
+
+	template<typename T>
+	__attribute__((target("avx2"))) static T dot(const T *a, const T *b, std::size_t count)
+	{
+		return SimdKernels<T, bytes>::dot(a, b, count);
+	}
+
+	template<typename T>
+	__attribute__((target("avx2"))) static std::size_t find(const T *src, std::size_t count, T value)
+	{
+		return SimdKernels<T, bytes>::find(src, count, value);
+	}
+};
+
+struct Avx512Kernels: Sse2Kernels
+{
+	static constexpr std::size_t bytes = 64;
+
+	template<typename T>
+	__attribute__((target("avx512f"))) static void fill(T *dst, std::size_t count, T value)
+	{
+		SimdKernels<T, bytes>::fill(dst, count, value);
+	}
+
+	template<typename T>
+	__attribute__((target("avx512f"))) static T sum(const T *src, std::size_t count)
+	{
+		return SimdKernels<T, bytes>::sum(src, count);
+	}
+
+	template<typename T>
+	__attribute__((target("avx512f"))) static T min(const T *src, std::size_t count)
+	{
+		return SimdKernels<T, bytes>::min(src, count);
+	}
+
+	template<typename T>
+	__attribute__((target("avx512f"))) static T max(const T *src, std::size_t count)
+	{
+		return SimdKernels<T, bytes>::max(src, count);
+	}
+
+	template<typename T>
+	__attribute__((target("avx512f"))) static T dot(const T *a, const T *b, std::size_t count)
+	{
+		return SimdKernels<T, bytes>::dot(a, b, count);
+	}
+
+	template<typename T>
+	__attribute__((target("avx512f"))) static std::size_t find(const T *src, std::size_t count, T value)
+	{
+		return SimdKernels<T, bytes>::find(src, count, value);
+	}
+};
+#endif
+
+template<typename Op>
+auto simd_dispatch(Op op, std::false_type) -> decltype(op(ScalarKernels()))
+{
+	return op(ScalarKernels());
+}
+
+template<typename Op>
+auto simd_dispatch(Op op, std::true_type) -> decltype(op(ScalarKernels()))
+{
+	switch(simd_isa()) {
+#if defined(__x86_64__)
+	case SimdIsa::avx512:
+		return op(Avx512Kernels());
+	case SimdIsa::avx2:
+		return op(Avx2Kernels());
+#endif
+	case SimdIsa::sse2:
+		return op(Sse2Kernels());
+	default:
+		return op(ScalarKernels());
+	}
+}
+
+/**
+ * Call op with the kernels of the current instruction set, or with the
+ * scalar ones when T cannot be packed.
+ */
+template<typename T, typename Op>
+auto simd_dispatch(Op op) -> decltype(op(ScalarKernels()))
+{
+	return simd_dispatch(op, is_simd_type<T>());
+}
+
+
+/**
+ * Vector statistics
+ *
+ * The Stats policy of Vector is told about each allocation, growth and
+ * destruction. NoVectorStats ignores them in empty inline functions,
+ * which compile to nothing. AtomicVectorStats aggregates them per
+ * element type, across all threads, with relaxed atomic operations,
+ * and prints a report at exit. Build with -DVECTOR_STATS to make it
+ * the default of every Vector.
+ */
+
+/**
+ * Counters of all the vectors of one element type. Each type gets its
+ * own cache line.
+ */
+struct alignas(64) VectorTypeStats
+{
+	explicit VectorTypeStats(const std::string &name):
+		name(name),
+		allocations(0),
+		reallocations(0),
+		relocated_bytes(0),
+		relocation_ns(0),
+		peak_capacity_bytes(0),
+		destroyed(0),
+		wasted_bytes(0),
+		next(nullptr)
+	{
+	}
+
+	std::string name;
+	std::atomic<std::uint64_t> allocations;
+	std::atomic<std::uint64_t> reallocations;
+	// Bytes of the elements moved to a new block (realloc may remap
+	// them instead of copying).
+	std::atomic<std::uint64_t> relocated_bytes;
+	std::atomic<std::uint64_t> relocation_ns;
+	std::atomic<std::uint64_t> peak_capacity_bytes;
+	std::atomic<std::uint64_t> destroyed;
+	// Unused capacity of the vectors when they are destroyed.
+	std::atomic<std::uint64_t> wasted_bytes;
+	VectorTypeStats *next;
+};
+
+/**
+ * List of the types with statistics, printed at exit. The counters are
+ * never freed, so the report can run after the static objects are
+ * destroyed.
+ */
+class VectorStatsRegistry
+{
+public:
+	static VectorTypeStats *add(VectorTypeStats *stats)
+	{
+		static std::mutex mutex;
+		std::lock_guard<std::mutex> lock(mutex);
+		if(!head()) {
+			std::atexit(report);
+		}
+		stats->next = head();
+		head() = stats;
+		return stats;
+	}
+
+	static void report()
+	{
+		std::cerr << "Vector statistics (allocations, reallocations, relocated bytes, "
+		          << "time relocating, peak capacity, vectors destroyed, wasted bytes)" << std::endl;
+		for(VectorTypeStats *stats = head(); stats; stats = stats->next) {
+			std::cerr << "  " << stats->name << ": " << stats->allocations << ", "
+			          << stats->reallocations << ", " << stats->relocated_bytes << " B, "
+			          << stats->relocation_ns / 1e6 << " ms, " << stats->peak_capacity_bytes << " B, "
+			          << stats->destroyed << ", " << stats->wasted_bytes << " B" << std::endl;
+		}
+	}
+
+	static VectorTypeStats *&head()
+	{
+		static VectorTypeStats *head = nullptr;
+		return head;
+	}
+};
+
+struct NoVectorStats
+{
+	struct Timer {};
+
+	template<typename T>
+	static Timer reserving(std::size_t, std::size_t, std::size_t)
+	{
+		return Timer();
+	}
+
+	template<typename T>
+	static void reserved(Timer)
+	{
+	}
+
+	template<typename T>
+	static void allocated(std::size_t)
+	{
+	}
+
+	template<typename T>
+	static void destroyed(std::size_t, std::size_t)
+	{
+	}
+};
+
+struct AtomicVectorStats
+{
+	typedef std::chrono::steady_clock::time_point Timer;
+
+	/**
+	 * Return the counters of type T, registered on first use.
+	 */
+	template<typename T>
+	static VectorTypeStats &of()
+	{
+		static VectorTypeStats *stats = VectorStatsRegistry::add(create(type_name<T>()));
+		return *stats;
+	}
+
+	/**
+	 * A vector of size elements goes from old_capacity to capacity:
+	 * count the allocation or relocation and start timing it. A first
+	 * allocation relocates nothing and gets a null timer, which
+	 * reserved() ignores.
+	 */
+	template<typename T>
+	static Timer reserving(std::size_t size, std::size_t old_capacity, std::size_t capacity)
+	{
+		VectorTypeStats &stats = of<T>();
+		peak(stats, capacity*sizeof(T));
+		if(old_capacity == 0) {
+			stats.allocations.fetch_add(1, std::memory_order_relaxed);
+			return Timer();
+		}
+
+		stats.reallocations.fetch_add(1, std::memory_order_relaxed);
+		stats.relocated_bytes.fetch_add(size*sizeof(T), std::memory_order_relaxed);
+		return std::chrono::steady_clock::now();
+	}
+
+	template<typename T>
+	static void reserved(Timer start)
+	{
+		if(start == Timer()) {
+			return;
+		}
+		std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+		of<T>().relocation_ns.fetch_add(elapsed.count(), std::memory_order_relaxed);
+	}
+
+	/**
+	 * A block of capacity elements is allocated, by a copy.
+	 */
+	template<typename T>
+	static void allocated(std::size_t capacity)
+	{
+		VectorTypeStats &stats = of<T>();
+		stats.allocations.fetch_add(1, std::memory_order_relaxed);
+		peak(stats, capacity*sizeof(T));
+	}
+
+	template<typename T>
+	static void destroyed(std::size_t size, std::size_t capacity)
+	{
+		VectorTypeStats &stats = of<T>();
+		stats.destroyed.fetch_add(1, std::memory_order_relaxed);
+		stats.wasted_bytes.fetch_add((capacity - size)*sizeof(T), std::memory_order_relaxed);
+	}
+
+private:
+	/**
+	 * Allocate the counters of a type on their own cache line (new
+	 * ignores extended alignments before C++17).
+	 */
+	static VectorTypeStats *create(const std::string &name)
+	{
+		void *memory = nullptr;
+		if(posix_memalign(&memory, alignof(VectorTypeStats), sizeof(VectorTypeStats)) != 0) {
+			throw std::bad_alloc();
+		}
+		return new (memory) VectorTypeStats(name);
+	}
+
+	static void peak(VectorTypeStats &stats, std::uint64_t bytes)
+	{
+		std::uint64_t current = stats.peak_capacity_bytes.load(std::memory_order_relaxed);
+		while(current < bytes &&
+		      !stats.peak_capacity_bytes.compare_exchange_weak(current, bytes, std::memory_order_relaxed)) {
+		}
+	}
+
+	template<typename T>
+	static std::string type_name()
+	{
+		int status = 0;
+		char *demangled = abi::__cxa_demangle(typeid(T).name(), nullptr, nullptr, &status);
+		std::string name = status == 0 ? demangled : typeid(T).name();
+		std::free(demangled);
+		return name;
+	}
+};
+
+#ifdef VECTOR_STATS
+typedef AtomicVectorStats DefaultVectorStats;
+#else
+typedef NoVectorStats DefaultVectorStats;
+#endif
+
+
+/**
+ * Dynamic array of T. The memory comes from the Alloc policy and grows
+ * as told by the Growth policy, the Stats policy keeping count. No
+ * member is virtual: element access and iteration compile down to
+ * pointer arithmetic, which the compiler can inline and vectorize.
+ */
+template<typename T, typename Alloc = typename DefaultAllocator<T>::type, typename Growth = DoublingGrowth,
+         typename Stats = DefaultVectorStats>
+class Vector
+{
+public:
+	typedef T* iterator;
+	typedef const T* const_iterator;
+
+	/**
+	 * Default constructor
+	 */
+	Vector(const Alloc &alloc = Alloc()):
+		m_capacity(0),
+		m_size(0),
+		m_array(nullptr),
+		m_alloc(alloc)
+	{
+		// Nothing is allocated until the first element is pushed: an
+		// unused vector never touches the allocator.
+	}
+
+	/**
+	 * Copy constructor
+	 */
+	Vector(const Vector &v):
+		m_capacity(v.capacity()),
+		m_size(v.size()),
+		m_array(nullptr),
+		m_alloc(v.m_alloc)
+	{
+		// The array allocated is just a chunk of data without any
+		// initialization. The allocators leave the memory
+		// uninitialized, and unlike new[] their blocks can be grown in
+		// place. We have just built a kind of memory pool.
+		m_array = allocate(m_capacity);
+		if(m_capacity) {
+			Stats::template allocated<T>(m_capacity);
+		}
+
+		// We cast the memory chunk to the appropriate pointer type.
+		T* dst = reinterpret_cast<T*>(m_array);
+
+		// We copy the content
+		for(std::size_t i=0; i<m_size; ++i) {
+			// We use the placement new to call the copy ctor of "v" in
+			// order to initialize the previously allocated memory.
+			new (dst+i) T(v[i]);
+		}
+	}
+
+	/**
+	 * Move constructor: the block of v is stolen, v is left empty.
+	 */
+	Vector(Vector &&v) noexcept:
+		m_capacity(v.m_capacity),
+		m_size(v.m_size),
+		m_array(v.m_array),
+		m_alloc(v.m_alloc)
+	{
+		// Resetting all values of v to properly delete the object.
+		v.m_capacity = 0;
+		v.m_size = 0;
+		v.m_array = nullptr;
+	}
+
+	/**
+	 * Move assignment: the elements are destroyed, then the block of v
+	 * is stolen as by the move constructor.
+	 */
+	Vector &operator=(Vector &&v) noexcept
+	{
+		if(this != &v) {
+			release();
+			m_capacity = v.m_capacity;
+			m_size = v.m_size;
+			m_array = v.m_array;
+			m_alloc = v.m_alloc;
+			v.m_capacity = 0;
+			v.m_size = 0;
+			v.m_array = nullptr;
+		}
+		return *this;
+	}
+
+	/**
+	 * Destructor
+	 */
+	~Vector()
+	{
+		release();
+	}
+
+	/**
+	 * Append a value in the vector. If the vector is full a new chunk
+	 * will be allocated, its capacity given by the growth policy. Then
+	 * the old content is moved in the new one.
+	 *
+	 * @sa emplace_back
+	 */
+	void push_back(const T &value)
+	{
+		emplace_back(value);
+	}
+
+	/**
+	 * Append a value in the vector, moving it instead of copying it.
+	 */
+	void push_back(T &&value)
+	{
+		emplace_back(std::move(value));
+	}
+
+	/**
+	 * Append an element built in place from args, and return it.
+	 */
+	template<typename... Args>
+	T & emplace_back(Args&&... args)
+	{
+		T* dst = reinterpret_cast<T*>(m_array);
+
+		// If the size is more or equal to the current capacity, we must
+		// reserve a bigger memory chunk. The arguments may refer to an
+		// element of the vector, so the new element is built before
+		// the elements move, then moved in place.
+		if(m_size >= m_capacity) {
+			T value(std::forward<Args>(args)...);
+			reserve(Growth::next(m_capacity));
+			dst = reinterpret_cast<T*>(m_array);
+			new (dst + m_size) T(std::move(value));
+		}
+		else {
+			// Call the ctor to append the new element. This is done by
+			// using the placement new op.
+			new (dst + m_size) T(std::forward<Args>(args)...);
+		}
+		return dst[m_size++];
+	}
+
+	/**
+	 * Remove the last element. The vector must not be empty.
+	 */
+	void pop_back()
+	{
+		shrink(m_size - 1);
+	}
+
+	/**
+	 * Append the elements of the range [first, last), with a single
+	 * reservation. The range must not be part of the vector. Use move
+	 * iterators to move the elements instead of copying them.
+	 */
+	template<typename ForwardIt>
+	void append(ForwardIt first, ForwardIt last)
+	{
+		std::size_t count = std::distance(first, last);
+		if(m_size + count > m_capacity) {
+			reserve(std::max(m_size + count, Growth::next(m_capacity)));
+		}
+
+		T* dst = reinterpret_cast<T*>(m_array);
+		for(; first != last; ++first) {
+			new (dst + m_size) T(*first);
+			m_size++;
+		}
+	}
+
+	/**
+	 * Insert the elements of the range [first, last) before pos and
+	 * return an iterator to the first of them. The range must not be
+	 * part of the vector. The elements are appended, then rotated in
+	 * place.
+	 */
+	template<typename ForwardIt>
+	iterator insert(const_iterator pos, ForwardIt first, ForwardIt last)
+	{
+		std::size_t index = pos - cbegin();
+		std::size_t size = m_size;
+		append(first, last);
+		std::rotate(begin() + index, begin() + size, end());
+		return begin() + index;
+	}
+
+	/**
+	 * Insert a value before pos and return an iterator to it.
+	 */
+	iterator insert(const_iterator pos, T value)
+	{
+		std::size_t index = pos - cbegin();
+		emplace_back(std::move(value));
+		std::rotate(begin() + index, end() - 1, end());
+		return begin() + index;
+	}
+
+	/**
+	 * Change the number of elements: the last ones are destroyed, or
+	 * value initialized ones are appended.
+	 */
+	void resize(std::size_t size)
+	{
+		shrink(size);
+		reserve(size);
+		T* dst = reinterpret_cast<T*>(m_array);
+		for(; m_size<size; ++m_size) {
+			new (dst + m_size) T();
+		}
+	}
+
+	/**
+	 * Change the number of elements, appending copies of value.
+	 */
+	void resize(std::size_t size, const T &value)
+	{
+		shrink(size);
+		if(m_size < size) {
+			// value may be an element of the vector.
+			T copy(value);
+			reserve(size);
+			T* dst = reinterpret_cast<T*>(m_array);
+			for(; m_size<size; ++m_size) {
+				new (dst + m_size) T(copy);
+			}
+		}
+	}
+
+	/**
+	 * Reserve a new memory chunk to store vector's elements. If the
+	 * given capacity is less or equal than the current capacity, it
+	 * won't do anything.
+	 *
+	 * @sa Relocator
+	 */
+	void reserve(std::size_t capacity)
+	{
+		if(capacity > m_capacity) {
+			// The elements are moved by the relocation engine: a byte
+			// copy (or a remapping) for trivially relocatable types, a
+			// move and destruction of each element otherwise.
+			auto timer = Stats::template reserving<T>(m_size, m_capacity, capacity);
+			m_array = Relocator<T>::relocate(m_alloc, m_array, m_size, m_capacity, capacity);
+			m_capacity = capacity;
+			Stats::template reserved<T>(timer);
+		}
+	}
+
+	/**
+	 * Reduce the capacity to the size, giving the unused memory back
+	 * to the allocator.
+	 */
+	void shrink_to_fit()
+	{
+		if(m_size == m_capacity) {
+			return;
+		}
+
+		if(m_size == 0) {
+			Stats::template destroyed<T>(0, m_capacity);
+			m_alloc.deallocate(m_array, m_capacity*sizeof(T));
+			m_array = nullptr;
+		}
+		else {
+			auto timer = Stats::template reserving<T>(m_size, m_capacity, m_size);
+			m_array = Relocator<T>::relocate(m_alloc, m_array, m_size, m_capacity, m_size);
+			Stats::template reserved<T>(timer);
+		}
+		m_capacity = m_size;
+	}
+
+	/**
+	 * Begin iterator.
+	 */
+	iterator begin() const
+	{
+		T* dst = reinterpret_cast<T*>(m_array);
+		return dst;
+	}
+
+	/**
+	 * Begin const_iterator.
+	 */
+	const_iterator cbegin() const
+	{
+		return begin();
+	}
+
+	/**
+	 * End iterator.
+	 */
+	iterator end() const
+	{
+		T* dst = reinterpret_cast<T*>(m_array);
+		return dst+m_size;
+	}
+
+	/**
+	 * End const_iterator.
+	 */
+	const_iterator cend() const
+	{
+		return end();
+	}
+
+	/**
+	 * Return the element stored at the given index. No out of bounds
+	 * check is done here.
+	 */
+	T & operator[](std::size_t index) const
+	{
+		T* dst = reinterpret_cast<T*>(m_array);
+		return dst[index];
+	}
+
+	/**
+	 * Return the number of elements stored in the vector.
+	 */
+	std::size_t size() const
+	{
+		return m_size;
+	}
+
+	/**
+	 * Return the capacity (in term of number of elements) of the vector.
+	 */
+	std::size_t capacity() const
+	{
+		return m_capacity;
+	}
+
+	/**
+	 * Bulk operations, run by the SIMD kernels of the best instruction
+	 * set available for arithmetic types.
+	 *
+	 * @sa simd_dispatch
+	 */
+
+	/**
+	 * Set all elements to value.
+	 */
+	void fill(const T &value)
+	{
+		T* dst = begin();
+		std::size_t count = m_size;
+		simd_dispatch<T>([&](auto kernels) {kernels.fill(dst, count, value);});
+	}
+
+	/**
+	 * Replace each element x by f(x). For arithmetic types f is also
+	 * called with packs of elements, so it must be generic and only use
+	 * operators, such as [](auto x) {return x * 2 + 1;}.
+	 */
+	template<typename F>
+	void transform(F f)
+	{
+		T* dst = begin();
+		std::size_t count = m_size;
+		simd_dispatch<T>([&](auto kernels) {kernels.transform(dst, count, f);});
+	}
+
+	/**
+	 * Return the sum of the elements, 0 for an empty vector.
+	 */
+	T sum() const
+	{
+		const T* src = begin();
+		std::size_t count = m_size;
+		return simd_dispatch<T>([&](auto kernels) {return kernels.sum(src, count);});
+	}
+
+	/**
+	 * Return the smallest element (the largest value of T for an empty
+	 * vector).
+	 */
+	T min() const
+	{
+		const T* src = begin();
+		std::size_t count = m_size;
+		return simd_dispatch<T>([&](auto kernels) {return kernels.min(src, count);});
+	}
+
+	/**
+	 * Return the largest element (the lowest value of T for an empty
+	 * vector).
+	 */
+	T max() const
+	{
+		const T* src = begin();
+		std::size_t count = m_size;
+		return simd_dispatch<T>([&](auto kernels) {return kernels.max(src, count);});
+	}
+
+	/**
+	 * Return the dot product with a vector of the same size.
+	 */
+	template<typename OtherAlloc, typename OtherGrowth, typename OtherStats>
+	T dot(const Vector<T, OtherAlloc, OtherGrowth, OtherStats> &other) const
+	{
+		if(other.size() != m_size) {
+			throw std::length_error("dot product of vectors of different sizes");
+		}
+
+		const T* a = begin();
+		const T* b = other.begin();
+		std::size_t count = m_size;
+		return simd_dispatch<T>([&](auto kernels) {return kernels.dot(a, b, count);});
+	}
+
+	/**
+	 * Return an iterator to the first element equal to value, or end().
+	 */
+	iterator find(const T &value) const
+	{
+		const T* src = begin();
+		std::size_t count = m_size;
+		return begin() + simd_dispatch<T>([&](auto kernels) {return kernels.find(src, count, value);});
+	}
+
+private:
+	static_assert(alignof(T) <= Alloc::alignment,
+	              "the allocator does not align T enough");
+
+	/**
+	 * Destroy the elements past size, if any.
+	 */
+	void shrink(std::size_t size)
+	{
+		T* dst = reinterpret_cast<T*>(m_array);
+		while(m_size > size) {
+			dst[--m_size].~T();
+		}
+	}
+
+	/**
+	 * Destroy the elements and free the memory chunk.
+	 */
+	void release()
+	{
+		if(m_capacity) {
+			Stats::template destroyed<T>(m_size, m_capacity);
+		}
+
+		// Before freeing the memory, we must call each element's
+		// destructor.
+		shrink(0);
+
+		// Then we can free the memory chunk.
+		m_alloc.deallocate(m_array, m_capacity*sizeof(T));
+	}
+
+	/**
+	 * Allocate an uninitialized chunk for capacity elements.
+	 */
+	char *allocate(std::size_t capacity)
+	{
+		return static_cast<char *>(m_alloc.allocate(capacity*sizeof(T)));
+	}
+
+	std::size_t m_capacity;
+	std::size_t m_size;
+	char *m_array;
+	Alloc m_alloc;
+};
+
+
+/**
+ * Dynamic array of T storing up to N elements inline, in the object
+ * itself: a vector that never grows past N never touches the
+ * allocator. Past N, the elements are moved to a heap block which then
+ * grows like a Vector.
+ */
+template<typename T, std::size_t N = 8, typename Alloc = typename DefaultAllocator<T>::type, typename Growth = DoublingGrowth>
+class SmallVector
+{
+public:
+	typedef T* iterator;
+	typedef const T* const_iterator;
+
+	/**
+	 * Default constructor
+	 */
+	SmallVector(const Alloc &alloc = Alloc()):
+		m_capacity(N),
+		m_size(0),
+		m_array(inline_array()),
+		m_alloc(alloc)
+	{
+	}
+
+	/**
+	 * Copy constructor: the copy is inline when it fits.
+	 */
+	SmallVector(const SmallVector &v):
+		SmallVector(v.m_alloc)
+	{
+		reserve(v.size());
+		T* dst = reinterpret_cast<T*>(m_array);
+		for(; m_size<v.size(); ++m_size) {
+			new (dst+m_size) T(v[m_size]);
+		}
+	}
+
+	/**
+	 * Move constructor: a heap block is stolen, inline elements are
+	 * moved one by one. v is left empty.
+	 */
+	SmallVector(SmallVector &&v) noexcept(std::is_nothrow_move_constructible<T>::value):
+		SmallVector(v.m_alloc)
+	{
+		take(v);
+	}
+
+	/**
+	 * Move assignment, same as the move constructor once the current
+	 * elements are destroyed.
+	 */
+	SmallVector &operator=(SmallVector &&v) noexcept(std::is_nothrow_move_constructible<T>::value)
+	{
+		if(this != &v) {
+			release();
+			m_alloc = v.m_alloc;
+			take(v);
+		}
+		return *this;
+	}
+
+	/**
+	 * Destructor
+	 */
+	~SmallVector()
+	{
+		release();
+	}
+
+	/**
+	 * Append a value in the vector. Once the inline storage is full,
+	 * the elements are moved to a heap block.
+	 *
+	 * @sa Vector::push_back
+	 */
+	void push_back(const T &value)
+	{
+		emplace_back(value);
+	}
+
+	/**
+	 * Append a value in the vector, moving it instead of copying it.
+	 */
+	void push_back(T &&value)
+	{
+		emplace_back(std::move(value));
+	}
+
+	/**
+	 * Append an element built in place from args, and return it.
+	 *
+	 * @sa Vector::emplace_back
+	 */
+	template<typename... Args>
+	T & emplace_back(Args&&... args)
+	{
+		if(m_size >= m_capacity) {
+			T value(std::forward<Args>(args)...);
+			reserve(Growth::next(m_capacity));
+			new (begin() + m_size) T(std::move(value));
+		}
+		else {
+			new (begin() + m_size) T(std::forward<Args>(args)...);
+		}
+		return begin()[m_size++];
+	}
+
+	/**
+	 * Make room for capacity elements. Does nothing while they fit in
+	 * the current storage, inline or not.
+	 */
+	void reserve(std::size_t capacity)
+	{
+		if(capacity <= m_capacity) {
+			return;
+		}
+
+		if(is_inline()) {
+			// The inline storage cannot be reallocated: the elements
+			// are moved to a new block.
+			char *array = static_cast<char *>(m_alloc.allocate(capacity*sizeof(T)));
+			try {
+				Relocator<T>::move(array, m_array, m_size);
+			}
+			catch(...) {
+				m_alloc.deallocate(array, capacity*sizeof(T));
+				throw;
+			}
+			m_array = array;
+		}
+		else {
+			m_array = Relocator<T>::relocate(m_alloc, m_array, m_size, m_capacity, capacity);
+		}
+		m_capacity = capacity;
+	}
+
+	/**
+	 * Tell if the elements are stored inline.
+	 */
+	bool is_inline() const
+	{
+		return m_array == inline_array();
+	}
+
+	/**
+	 * Begin iterator.
+	 */
+	iterator begin() const
+	{
+		return reinterpret_cast<T*>(m_array);
+	}
+
+	/**
+	 * Begin const_iterator.
+	 */
+	const_iterator cbegin() const
+	{
+		return begin();
+	}
+
+	/**
+	 * End iterator.
+	 */
+	iterator end() const
+	{
+		return begin() + m_size;
+	}
+
+	/**
+	 * End const_iterator.
+	 */
+	const_iterator cend() const
+	{
+		return end();
+	}
+
+	/**
+	 * Return the element stored at the given index. No out of bounds
+	 * check is done here.
+	 */
+	T & operator[](std::size_t index) const
+	{
+		return begin()[index];
+	}
+
+	/**
+	 * Return the number of elements stored in the vector.
+	 */
+	std::size_t size() const
+	{
+		return m_size;
+	}
+
+	/**
+	 * Return the capacity (in term of number of elements) of the vector.
+	 */
+	std::size_t capacity() const
+	{
+		return m_capacity;
+	}
+
+private:
+	static_assert(N > 0, "use Vector when nothing is stored inline");
+	static_assert(alignof(T) <= Alloc::alignment,
+	              "the allocator does not align T enough");
+
+	char *inline_array() const
+	{
+		return const_cast<char *>(reinterpret_cast<const char *>(m_inline));
+	}
+
+	/**
+	 * Destroy the elements and free the heap block, leaving the vector
+	 * empty and inline.
+	 */
+	void release()
+	{
+		T* dst = reinterpret_cast<T*>(m_array);
+		for(std::size_t i=0; i<m_size; ++i) {
+			dst[i].~T();
+		}
+		if(!is_inline()) {
+			m_alloc.deallocate(m_array, m_capacity*sizeof(T));
+		}
+		m_capacity = N;
+		m_size = 0;
+		m_array = inline_array();
+	}
+
+	/**
+	 * Take the elements of v, an empty inline vector being the
+	 * destination. v is left empty and inline.
+	 */
+	void take(SmallVector &v)
+	{
+		if(v.is_inline()) {
+			T* src = reinterpret_cast<T*>(v.m_array);
+			T* dst = reinterpret_cast<T*>(m_array);
+			for(; m_size<v.m_size; ++m_size) {
+				new (dst+m_size) T(std::move(src[m_size]));
+			}
+			v.release();
+			return;
+		}
+
+		m_capacity = v.m_capacity;
+		m_size = v.m_size;
+		m_array = v.m_array;
+		v.m_capacity = N;
+		v.m_size = 0;
+		v.m_array = v.inline_array();
+	}
+
+	std::size_t m_capacity;
+	std::size_t m_size;
+	char *m_array;
+	Alloc m_alloc;
+	typename std::aligned_storage<sizeof(T), alignof(T)>::type m_inline[N];
+};
+
+
+/**
+ * Header of the file backing a MappedVector. The elements follow as
+ * raw bytes, right after the header.
+ */
+struct VectorFileHeader
+{
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t element_size;
+	std::uint64_t size;
+	// Padding so that the elements start on a cache line.
+	char reserved[40];
+};
+
+static const char vector_file_magic[8] = {'V', 'E', 'C', 'T', 'O', 'R', '\0', '\0'};
+static const std::uint32_t vector_file_version = 1;
+
+
+/**
+ * Dynamic array of T stored in a file mapped in memory (MAP_SHARED)
+ * instead of an allocator block.
+ *
+ * The content persists: reopening the file gives back the same
+ * elements immediately, without parsing or copying them, and the
+ * kernel only reads the pages that are touched, so the data can be
+ * larger than the memory. reserve grows the file with ftruncate and
+ * the mapping with mremap. The file is trimmed to the elements when
+ * the vector is destroyed. Only trivially copyable types can be
+ * stored.
+ */
+template<typename T, typename Growth = DoublingGrowth>
+class MappedVector
+{
+public:
+	static_assert(std::is_trivially_copyable<T>::value,
+	              "only trivially copyable elements can be mapped");
+	static_assert(sizeof(VectorFileHeader) % alignof(T) == 0,
+	              "the elements would not be aligned after the header");
+
+	typedef T* iterator;
+	typedef const T* const_iterator;
+
+	/**
+	 * Open the file, creating it if needed. Throw std::runtime_error if
+	 * it cannot be opened or mapped, or holds something else than T
+	 * elements.
+	 */
+	explicit MappedVector(const std::string &path):
+		m_fd(-1),
+		m_map(MAP_FAILED),
+		m_length(0)
+	{
+		m_fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+		if(m_fd < 0) {
+			throw std::runtime_error("MappedVector: cannot open " + path);
+		}
+
+		struct stat st;
+		bool stated = ::fstat(m_fd, &st) == 0;
+		bool created = stated && st.st_size == 0;
+		if(created && ::ftruncate(m_fd, sizeof(VectorFileHeader)) == 0) {
+			st.st_size = sizeof(VectorFileHeader);
+		}
+		if(stated && std::size_t(st.st_size) >= sizeof(VectorFileHeader)) {
+			m_length = st.st_size;
+			m_map = ::mmap(nullptr, m_length, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+		}
+		if(m_map == MAP_FAILED) {
+			::close(m_fd);
+			throw std::runtime_error("MappedVector: cannot map " + path);
+		}
+
+		VectorFileHeader *header = static_cast<VectorFileHeader *>(m_map);
+		if(created) {
+			std::memcpy(header->magic, vector_file_magic, sizeof(vector_file_magic));
+			header->version = vector_file_version;
+			header->element_size = sizeof(T);
+			header->size = 0;
+		}
+		else if(std::memcmp(header->magic, vector_file_magic, sizeof(vector_file_magic)) != 0 ||
+		        header->version != vector_file_version ||
+		        header->element_size != sizeof(T) ||
+		        header->size > capacity()) {
+			::munmap(m_map, m_length);
+			::close(m_fd);
+			throw std::runtime_error("MappedVector: bad file " + path);
+		}
+	}
+
+	MappedVector(const MappedVector &) = delete;
+	MappedVector &operator=(const MappedVector &) = delete;
+
+	/**
+	 * Unmap the file and trim it to the elements. The modified pages
+	 * are written back by the kernel; call sync first to wait for it.
+	 */
+	~MappedVector()
+	{
+		std::size_t length = sizeof(VectorFileHeader) + size()*sizeof(T);
+		::munmap(m_map, m_length);
+		if(::ftruncate(m_fd, length) != 0) {
+			// The file keeps its unused capacity, which is harmless.
+		}
+		::close(m_fd);
+	}
+
+	/**
+	 * Append a value, growing the file as told by the growth policy
+	 * when it is full.
+	 */
+	void push_back(const T &value)
+	{
+		if(size() >= capacity()) {
+			// value may be an element of the vector, which moves.
+			T copy = value;
+			reserve(Growth::next(capacity()));
+			begin()[header()->size++] = copy;
+		}
+		else {
+			begin()[header()->size++] = value;
+		}
+	}
+
+	/**
+	 * Append the elements of the range [first, last), with a single
+	 * reservation. The range must not be part of the vector.
+	 */
+	template<typename ForwardIt>
+	void append(ForwardIt first, ForwardIt last)
+	{
+		std::size_t count = std::distance(first, last);
+		if(size() + count > capacity()) {
+			reserve(std::max(size() + count, Growth::next(capacity())));
+		}
+		std::copy(first, last, end());
+		header()->size += count;
+	}
+
+	/**
+	 * Change the number of elements, appending value initialized ones.
+	 */
+	void resize(std::size_t size)
+	{
+		reserve(size);
+		if(size > this->size()) {
+			std::fill(end(), begin() + size, T());
+		}
+		header()->size = size;
+	}
+
+	/**
+	 * Grow the file and its mapping to hold capacity elements (rounded
+	 * up to whole pages). Throw std::runtime_error if the file cannot
+	 * grow, the vector being then unchanged.
+	 */
+	void reserve(std::size_t capacity)
+	{
+		if(capacity <= this->capacity()) {
+			return;
+		}
+
+		std::size_t page = ::sysconf(_SC_PAGESIZE);
+		std::size_t length = sizeof(VectorFileHeader) + capacity*sizeof(T);
+		length = (length + page - 1) / page * page;
+		if(::ftruncate(m_fd, length) != 0) {
+			throw std::runtime_error("MappedVector: cannot grow the file");
+		}
+
+		void *map = ::mremap(m_map, m_length, length, MREMAP_MAYMOVE);
+		if(map == MAP_FAILED) {
+			throw std::runtime_error("MappedVector: cannot grow the mapping");
+		}
+		m_map = map;
+		m_length = length;
+	}
+
+	/**
+	 * Write the modified pages back to the file and wait for it.
+	 */
+	void sync() const
+	{
+		::msync(m_map, m_length, MS_SYNC);
+	}
+
+	/**
+	 * Tell the kernel how the elements will be accessed, with
+	 * MADV_SEQUENTIAL (aggressive read-ahead, pages dropped behind) or
+	 * MADV_RANDOM (no read-ahead) for instance.
+	 */
+	void advise(int advice) const
+	{
+		::madvise(m_map, m_length, advice);
+	}
+
+	/**
+	 * Begin iterator.
+	 */
+	iterator begin() const
+	{
+		return reinterpret_cast<T*>(static_cast<char *>(m_map) + sizeof(VectorFileHeader));
+	}
+
+	/**
+	 * Begin const_iterator.
+	 */
+	const_iterator cbegin() const
+	{
+		return begin();
+	}
+
+	/**
+	 * End iterator.
+	 */
+	iterator end() const
+	{
+		return begin() + size();
+	}
+
+	/**
+	 * End const_iterator.
+	 */
+	const_iterator cend() const
+	{
+		return end();
+	}
+
+	/**
+	 * Return the element stored at the given index. No out of bounds
+	 * check is done here.
+	 */
+	T & operator[](std::size_t index) const
+	{
+		return begin()[index];
+	}
+
+	/**
+	 * Return the number of elements stored in the vector.
+	 */
+	std::size_t size() const
+	{
+		return header()->size;
+	}
+
+	/**
+	 * Return the number of elements the file can hold.
+	 */
+	std::size_t capacity() const
+	{
+		return (m_length - sizeof(VectorFileHeader)) / sizeof(T);
+	}
+
+private:
+	VectorFileHeader *header() const
+	{
+		return static_cast<VectorFileHeader *>(m_map);
+	}
+
+	int m_fd;
+	void *m_map;
+	std::size_t m_length;
+};
+
+
+/**
+ * Index arithmetic of the segmented vectors: segment k holds
+ * 2^FirstBits << k elements, so the elements before it fill a power of
+ * two minus the first segment, and the segment of an index is given by
+ * its highest bit once offset by the first segment. A fixed table of
+ * max_segments segments covers any 64 bit index.
+ */
+template<std::size_t FirstBits>
+struct SegmentLayout
+{
+	static constexpr std::size_t first_segment = std::size_t(1) << FirstBits;
+	static constexpr std::size_t max_segments = 64 - FirstBits;
+
+	static std::size_t segment_of(std::size_t index)
+	{
+		return 63 - __builtin_clzll(index + first_segment) - FirstBits;
+	}
+
+	static std::size_t segment_size(std::size_t k)
+	{
+		return first_segment << k;
+	}
+
+	static std::size_t first_index(std::size_t k)
+	{
+		return (first_segment << k) - first_segment;
+	}
+};
+
+
+/**
+ * Concurrent dynamic array of T, for many threads appending at once.
+ *
+ * The elements live in segments which are never moved nor freed
+ * before the vector: segment k holds 64 << k elements, so 58
+ * segments cover any index and element addresses are stable.
+ * push_back claims a slot with a single fetch_add on the size. The
+ * thread claiming the first slot of a missing segment is not
+ * special: every thread finding the segment missing allocates one and
+ * tries to publish it with a compare and swap, the losers freeing
+ * theirs. Nothing ever waits for another thread.
+ *
+ * Each segment starts with one ready bit per element, set with
+ * release semantics once the element is built: readers can iterate
+ * concurrently with writers, visiting the elements already published.
+ * Elements are never removed.
+ */
 template<typename T>
-class Vector
+class ConcurrentVector
 {
 public:
-	typedef T* iterator;
-	typedef const T* const_iterator;
+	static_assert(alignof(T) <= alignof(std::max_align_t),
+	              "over-aligned types are not supported");
+
+	// One word of ready bits per 64 elements at least.
+	typedef SegmentLayout<6> Layout;
+	static constexpr std::size_t max_segments = Layout::max_segments;
+
+	ConcurrentVector():
+		m_size(0)
+	{
+		for(auto &segment: m_segments) {
+			segment.store(nullptr, std::memory_order_relaxed);
+		}
+	}
+
+	ConcurrentVector(const ConcurrentVector &) = delete;
+	ConcurrentVector &operator=(const ConcurrentVector &) = delete;
 
 	/**
-	 * Default constructor
+	 * Destructor. No thread may still be appending.
+	 */
+	~ConcurrentVector()
+	{
+		std::size_t size = m_size.load(std::memory_order_acquire);
+		for(std::size_t k=0; k<max_segments; k++) {
+			char *segment = m_segments[k].load(std::memory_order_acquire);
+			if(!segment) {
+				continue;
+			}
+			for(std::size_t i=0; i<Layout::segment_size(k) && Layout::first_index(k) + i < size; i++) {
+				if(is_ready(segment, i)) {
+					elements(segment, k)[i].~T();
+				}
+			}
+			std::free(segment);
+		}
+	}
+
+	/**
+	 * Append a value and return its index. Safe to call from any
+	 * number of threads at once.
+	 */
+	template<typename... Args>
+	std::size_t emplace_back(Args&&... args)
+	{
+		std::size_t index = m_size.fetch_add(1, std::memory_order_relaxed);
+		std::size_t k = Layout::segment_of(index);
+		std::size_t offset = index - Layout::first_index(k);
+		char *segment = get_segment(k);
+
+		new (elements(segment, k) + offset) T(std::forward<Args>(args)...);
+
+		std::atomic<std::uint64_t> *ready = reinterpret_cast<std::atomic<std::uint64_t> *>(segment);
+		ready[offset / 64].fetch_or(std::uint64_t(1) << (offset % 64), std::memory_order_release);
+		return index;
+	}
+
+	std::size_t push_back(const T &value)
+	{
+		return emplace_back(value);
+	}
+
+	std::size_t push_back(T &&value)
+	{
+		return emplace_back(std::move(value));
+	}
+
+	/**
+	 * Return the element at the given index. It must have been
+	 * published: its push_back returned before, or ready(index) is
+	 * true. The reference stays valid as long as the vector.
+	 */
+	T & operator[](std::size_t index) const
+	{
+		std::size_t k = Layout::segment_of(index);
+		char *segment = m_segments[k].load(std::memory_order_acquire);
+		return elements(segment, k)[index - Layout::first_index(k)];
+	}
+
+	/**
+	 * Tell if the element at the given index is published.
+	 */
+	bool ready(std::size_t index) const
+	{
+		if(index >= size()) {
+			return false;
+		}
+		std::size_t k = Layout::segment_of(index);
+		char *segment = m_segments[k].load(std::memory_order_acquire);
+		return segment && is_ready(segment, index - Layout::first_index(k));
+	}
+
+	/**
+	 * Call f(index, element) on each published element, in index
+	 * order. Elements still being appended are skipped.
+	 */
+	template<typename F>
+	void visit(F f) const
+	{
+		std::size_t size = this->size();
+		for(std::size_t k=0; k<max_segments && Layout::first_index(k) < size; k++) {
+			char *segment = m_segments[k].load(std::memory_order_acquire);
+			if(!segment) {
+				continue;
+			}
+			const T *data = elements(segment, k);
+			for(std::size_t i=0; i<Layout::segment_size(k) && Layout::first_index(k) + i < size; i++) {
+				if(is_ready(segment, i)) {
+					f(Layout::first_index(k) + i, data[i]);
+				}
+			}
+		}
+	}
+
+	/**
+	 * Return the number of slots claimed, published or not.
+	 */
+	std::size_t size() const
+	{
+		return m_size.load(std::memory_order_acquire);
+	}
+
+private:
+	/**
+	 * Bytes of the ready bits at the start of segment k, rounded so
+	 * that the elements are aligned.
+	 */
+	static std::size_t elements_offset(std::size_t k)
+	{
+		std::size_t bytes = Layout::segment_size(k) / 64 * sizeof(std::uint64_t);
+		return (bytes + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+	}
+
+	static T *elements(char *segment, std::size_t k)
+	{
+		return reinterpret_cast<T*>(segment + elements_offset(k));
+	}
+
+	static bool is_ready(char *segment, std::size_t offset)
+	{
+		std::atomic<std::uint64_t> *ready = reinterpret_cast<std::atomic<std::uint64_t> *>(segment);
+		return ready[offset / 64].load(std::memory_order_acquire) >> (offset % 64) & 1;
+	}
+
+	/**
+	 * Return segment k, allocating and publishing it if needed.
+	 */
+	char *get_segment(std::size_t k)
+	{
+		char *segment = m_segments[k].load(std::memory_order_acquire);
+		if(segment) {
+			return segment;
+		}
+
+		char *created = static_cast<char *>(std::malloc(elements_offset(k) + Layout::segment_size(k)*sizeof(T)));
+		if(!created) {
+			throw std::bad_alloc();
+		}
+		std::atomic<std::uint64_t> *ready = reinterpret_cast<std::atomic<std::uint64_t> *>(created);
+		for(std::size_t w=0; w<Layout::segment_size(k) / 64; w++) {
+			new (ready + w) std::atomic<std::uint64_t>(0);
+		}
+
+		if(m_segments[k].compare_exchange_strong(segment, created, std::memory_order_acq_rel)) {
+			return created;
+		}
+		std::free(created);
+		return segment;
+	}
+
+	std::atomic<std::size_t> m_size;
+	std::atomic<char *> m_segments[max_segments];
+};
+
+
+/**
+ * Dynamic array of T without reallocation: like a deque, the elements
+ * live in segments of doubling size (16, 32, 64...) which never move.
+ * An append costs at worst the allocation of a new segment, O(1),
+ * instead of the copy of every element when a Vector grows, which
+ * removes the latency spikes of large vectors. Indexed access is a
+ * few bit operations away from a Vector's, and element addresses are
+ * stable.
+ */
+template<typename T, typename Alloc = typename DefaultAllocator<T>::type>
+class SegmentedVector
+{
+public:
+	typedef SegmentLayout<4> Layout;
+
+	/**
+	 * Random access iterator, an index into the vector.
+	 */
+	template<typename V, typename R>
+	class basic_iterator
+	{
+	public:
+		typedef std::random_access_iterator_tag iterator_category;
+		typedef T value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef R* pointer;
+		typedef R& reference;
+
+		basic_iterator(V *vector, std::size_t index):
+			m_vector(vector),
+			m_index(index)
+		{
+		}
+
+		reference operator*() const {return (*m_vector)[m_index];}
+		pointer operator->() const {return &(*m_vector)[m_index];}
+		reference operator[](difference_type n) const {return (*m_vector)[m_index + n];}
+		basic_iterator &operator++() {m_index++; return *this;}
+		basic_iterator &operator--() {m_index--; return *this;}
+		basic_iterator operator++(int) {return basic_iterator(m_vector, m_index++);}
+		basic_iterator operator--(int) {return basic_iterator(m_vector, m_index--);}
+		basic_iterator &operator+=(difference_type n) {m_index += n; return *this;}
+		basic_iterator &operator-=(difference_type n) {m_index -= n; return *this;}
+		basic_iterator operator+(difference_type n) const {return basic_iterator(m_vector, m_index + n);}
+		basic_iterator operator-(difference_type n) const {return basic_iterator(m_vector, m_index - n);}
+		difference_type operator-(const basic_iterator &other) const {return m_index - other.m_index;}
+		bool operator==(const basic_iterator &other) const {return m_index == other.m_index;}
+		bool operator!=(const basic_iterator &other) const {return m_index != other.m_index;}
+		bool operator<(const basic_iterator &other) const {return m_index < other.m_index;}
+		bool operator>(const basic_iterator &other) const {return m_index > other.m_index;}
+		bool operator<=(const basic_iterator &other) const {return m_index <= other.m_index;}
+		bool operator>=(const basic_iterator &other) const {return m_index >= other.m_index;}
+
+	private:
+		V *m_vector;
+		std::size_t m_index;
+	};
+
+	typedef basic_iterator<const SegmentedVector, T> iterator;
+	typedef basic_iterator<const SegmentedVector, const T> const_iterator;
+
+	/**
+	 * Default constructor, nothing is allocated.
 	 */
-	Vector():
-		m_capacity(1),
+	SegmentedVector(const Alloc &alloc = Alloc()):
 		m_size(0),
-		m_array(nullptr)
+		m_segments(),
+		m_alloc(alloc)
 	{
-		// The array allocated is just a chunk of data without any
-		// initialization. Allocating builtin types with the new
-		// operator leaves the memory uninitialized. We have just built
-		// a kind of memory pool.
-		m_array = new char [m_capacity*sizeof(T)];
 	}
 
+	SegmentedVector(const SegmentedVector &) = delete;
+	SegmentedVector &operator=(const SegmentedVector &) = delete;
+
 	/**
-	 * Copy constructor
+	 * Destructor
 	 */
-	Vector(const Vector<T> &v):
-		m_capacity(v.capacity()),
-		m_size(v.size()),
-		m_array(nullptr)
+	~SegmentedVector()
 	{
-		// Allocating a chunk of data without initialization (See
-		// default ctor).
-		m_array = new char [m_capacity*sizeof(T)];
+		for(std::size_t i=0; i<m_size; i++) {
+			(*this)[i].~T();
+		}
+		for(std::size_t k=0; k<Layout::max_segments && m_segments[k]; k++) {
+			m_alloc.deallocate(m_segments[k], Layout::segment_size(k)*sizeof(T));
+		}
+	}
 
-		// We cast the memory chunk to the appropriate pointer type.
-		T* dst = reinterpret_cast<T*>(m_array);
+	/**
+	 * Append a value in the vector. When the last segment is full, a
+	 * new one twice as large is allocated; no element moves.
+	 */
+	void push_back(const T &value)
+	{
+		emplace_back(value);
+	}
 
-		// We copy the content
-		for(std::size_t i=0; i<m_size; ++i) {
-			// We use the placement new to call the copy ctor of "v" in
-			// order to initialize the previously allocated memory.
-			new (dst+i) T(v[i]);
+	void push_back(T &&value)
+	{
+		emplace_back(std::move(value));
+	}
+
+	/**
+	 * Append an element built in place from args, and return it.
+	 */
+	template<typename... Args>
+	T & emplace_back(Args&&... args)
+	{
+		std::size_t k = Layout::segment_of(m_size);
+		if(!m_segments[k]) {
+			m_segments[k] = static_cast<T*>(m_alloc.allocate(Layout::segment_size(k)*sizeof(T)));
+		}
+
+		T* dst = m_segments[k] + (m_size - Layout::first_index(k));
+		new (dst) T(std::forward<Args>(args)...);
+		m_size++;
+		return *dst;
+	}
+
+	/**
+	 * Allocate the segments needed to hold capacity elements, so that
+	 * the following appends do not allocate.
+	 */
+	void reserve(std::size_t capacity)
+	{
+		for(std::size_t k=0; k<Layout::max_segments && Layout::first_index(k) < capacity; k++) {
+			if(!m_segments[k]) {
+				m_segments[k] = static_cast<T*>(m_alloc.allocate(Layout::segment_size(k)*sizeof(T)));
+			}
 		}
 	}
 
 	/**
-	 * Move constructor
+	 * Return the element stored at the given index. No out of bounds
+	 * check is done here.
 	 */
-	Vector(Vector<T> &&v):
-		m_capacity(v.m_capacity),
-		m_size(v.m_size),
-		m_array(v.m_array)
+	T & operator[](std::size_t index) const
 	{
-		// Resetting all values of v to properly delete the object.
-		v.m_capacity = 0;
-		v.m_size = 0;
-		v.m_array = nullptr;
-		std::cerr << "move ctor" << std::endl;
+		std::size_t k = Layout::segment_of(index);
+		return m_segments[k][index - Layout::first_index(k)];
+	}
+
+	/**
+	 * Call f on each element, segment by segment: a plain loop over
+	 * contiguous elements, faster than iterating over the indexes.
+	 */
+	template<typename F>
+	void visit(F f) const
+	{
+		for(std::size_t k=0; k<Layout::max_segments && Layout::first_index(k) < m_size; k++) {
+			T* data = m_segments[k];
+			std::size_t count = std::min(Layout::segment_size(k), m_size - Layout::first_index(k));
+			for(std::size_t i=0; i<count; i++) {
+				f(data[i]);
+			}
+		}
+	}
+
+	/**
+	 * Begin iterator.
+	 */
+	iterator begin() const
+	{
+		return iterator(this, 0);
+	}
+
+	/**
+	 * Begin const_iterator.
+	 */
+	const_iterator cbegin() const
+	{
+		return const_iterator(this, 0);
 	}
 
 	/**
-	 * Destructor
+	 * End iterator.
+	 */
+	iterator end() const
+	{
+		return iterator(this, m_size);
+	}
+
+	/**
+	 * End const_iterator.
+	 */
+	const_iterator cend() const
+	{
+		return const_iterator(this, m_size);
+	}
+
+	/**
+	 * Return the number of elements stored in the vector.
+	 */
+	std::size_t size() const
+	{
+		return m_size;
+	}
+
+	/**
+	 * Return the number of elements the allocated segments can hold.
+	 */
+	std::size_t capacity() const
+	{
+		std::size_t k = 0;
+		while(k < Layout::max_segments && m_segments[k]) {
+			k++;
+		}
+		return Layout::first_index(k);
+	}
+
+private:
+	static_assert(alignof(T) <= Alloc::alignment,
+	              "the allocator does not align T enough");
+
+	std::size_t m_size;
+	T* m_segments[Layout::max_segments];
+	Alloc m_alloc;
+};
+
+
+/**
+ * View of count contiguous elements, owned by another container.
+ */
+template<typename T>
+class Span
+{
+public:
+	typedef T* iterator;
+
+	Span(T *data, std::size_t size):
+		m_data(data),
+		m_size(size)
+	{
+	}
+
+	T *data() const
+	{
+		return m_data;
+	}
+
+	iterator begin() const
+	{
+		return m_data;
+	}
+
+	iterator end() const
+	{
+		return m_data + m_size;
+	}
+
+	T & operator[](std::size_t index) const
+	{
+		return m_data[index];
+	}
+
+	std::size_t size() const
+	{
+		return m_size;
+	}
+
+private:
+	T *m_data;
+	std::size_t m_size;
+};
+
+
+/**
+ * Array of records stored as a structure of arrays: each field has its
+ * own Vector (cache line aligned for arithmetic fields), so a scan of
+ * one field only reads the bytes of that field, in a contiguous column
+ * the compiler can vectorize. Rows are zipped back together by the
+ * iterators, which give tuples of references to the fields.
+ */
+template<typename... Fields>
+class SoAVector
+{
+public:
+	static_assert(sizeof...(Fields) > 0, "a record needs at least one field");
+
+	typedef std::tuple<Fields&...> reference;
+
+	template<std::size_t I>
+	using field_type = typename std::tuple_element<I, std::tuple<Fields...>>::type;
+
+	/**
+	 * Iterator on the rows, dereferencing to a tuple of references.
 	 */
-	virtual ~Vector()
+	class iterator
 	{
-		// Before freeing the memory, we must call each element's
-		// destructor.
-		T* dst = reinterpret_cast<T*>(m_array);
-		for(std::size_t i=0; i<m_size; ++i) {
-			dst[i].~T();
+	public:
+		typedef std::random_access_iterator_tag iterator_category;
+		typedef std::tuple<Fields...> value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef void pointer;
+		typedef SoAVector::reference reference;
+
+		iterator(const SoAVector *vector, std::size_t index):
+			m_vector(vector),
+			m_index(index)
+		{
 		}
 
-		// Then we can free the memory chunk.
-		delete [] m_array;
-	}
+		reference operator*() const {return m_vector->row(m_index);}
+		reference operator[](difference_type n) const {return m_vector->row(m_index + n);}
+		iterator &operator++() {m_index++; return *this;}
+		iterator &operator--() {m_index--; return *this;}
+		iterator operator++(int) {return iterator(m_vector, m_index++);}
+		iterator operator--(int) {return iterator(m_vector, m_index--);}
+		iterator &operator+=(difference_type n) {m_index += n; return *this;}
+		iterator &operator-=(difference_type n) {m_index -= n; return *this;}
+		iterator operator+(difference_type n) const {return iterator(m_vector, m_index + n);}
+		iterator operator-(difference_type n) const {return iterator(m_vector, m_index - n);}
+		difference_type operator-(const iterator &other) const {return m_index - other.m_index;}
+		bool operator==(const iterator &other) const {return m_index == other.m_index;}
+		bool operator!=(const iterator &other) const {return m_index != other.m_index;}
+		bool operator<(const iterator &other) const {return m_index < other.m_index;}
+		bool operator>(const iterator &other) const {return m_index > other.m_index;}
+		bool operator<=(const iterator &other) const {return m_index <= other.m_index;}
+		bool operator>=(const iterator &other) const {return m_index >= other.m_index;}
+
+	private:
+		const SoAVector *m_vector;
+		std::size_t m_index;
+	};
 
 	/**
-	 * Append a value in the vector. If the vector is full a new chunk
-	 * will be allocated by doubling the current capacity. Then the old
-	 * content is copied in the new one.
-	 *
-	 * @sa reserve
+	 * Default constructor, nothing is allocated.
 	 */
-	virtual void push_back(const T &value)
+	SoAVector():
+		m_size(0)
 	{
-		// If the size is more or equal to the current capacity, we must
-		// reserve a bigger memory chunk.
-		if(m_size >= m_capacity) {
-			reserve(m_capacity*2);
-		}
-
-		// Call the copy ctor to append the new element. This is done by
-		// using the placement new op.
-		T* dst = reinterpret_cast<T*>(m_array);
-		new (dst + m_size++) T(value);
 	}
 
 	/**
-	 * Reserve a new memory chunk to store vector's elements. If the
-	 * given capacity is less or equal than the current capacity, it
-	 * won't do anything.
+	 * Append a record, one value per field. If copying a field throws,
+	 * the fields already appended are removed.
 	 */
-	virtual void reserve(std::size_t capacity)
+	void push_back(const Fields&... values)
 	{
-		if(capacity > m_capacity) {
-			m_capacity = capacity;
-
-			// The old array was already allocated, so we just need to
-			// memcopy bytes in the new memory chunk. Because we used a
-			// builtin type to allocate the memory chunk, freeing it
-			// won't call the destructor of each array element. The
-			// memcopy is safe in this case.
-			char * old = m_array;
-			m_array = new char [m_capacity*sizeof(T)];
-			std::memcpy(m_array, old, m_size*sizeof(T));
-			delete [] old;
-		}
+		reserve_all(m_size + 1, std::index_sequence_for<Fields...>());
+		push_fields(std::index_sequence_for<Fields...>(), values...);
+		m_size++;
 	}
 
 	/**
-	 * Begin iterator.
+	 * Reserve room for capacity records in every column.
 	 */
-	virtual iterator begin() const
+	void reserve(std::size_t capacity)
 	{
-		T* dst = reinterpret_cast<T*>(m_array);
-		return dst;
+		reserve_all(capacity, std::index_sequence_for<Fields...>());
 	}
 
 	/**
-	 * Begin const_iterator.
+	 * Return the fields of the record at the given index.
 	 */
-	virtual const_iterator cbegin() const
+	reference row(std::size_t index) const
 	{
-		return begin();
+		return row(index, std::index_sequence_for<Fields...>());
 	}
 
 	/**
-	 * End iterator.
+	 * Return the field I of the record at the given index.
 	 */
-	virtual iterator end() const
+	template<std::size_t I>
+	field_type<I> & get(std::size_t index) const
 	{
-		T* dst = reinterpret_cast<T*>(m_array);
-		return dst+m_size;
+		return std::get<I>(m_columns)[index];
 	}
 
 	/**
-	 * End const_iterator.
+	 * Return the contiguous column of field I.
 	 */
-	virtual const_iterator cend() const
+	template<std::size_t I>
+	Span<field_type<I>> column() const
 	{
-		return end();
+		return Span<field_type<I>>(std::get<I>(m_columns).begin(), m_size);
 	}
 
-	/**
-	 * Return the element stored at the given index. No out of bounds
-	 * check is done here.
-	 */
-	virtual T & operator[](std::size_t index) const
+	iterator begin() const
 	{
-		T* dst = reinterpret_cast<T*>(m_array);
-		return dst[index];
+		return iterator(this, 0);
 	}
 
-	/**
-	 * Return the number of elements stored in the vector.
-	 */
-	virtual std::size_t size() const
+	iterator end() const
 	{
-		return m_size;
+		return iterator(this, m_size);
 	}
 
 	/**
-	 * Return the capacity (in term of number of elements) of the vector.
+	 * Return the number of records.
 	 */
-	virtual std::size_t capacity() const
+	std::size_t size() const
 	{
-		return m_capacity;
+		return m_size;
 	}
 
 private:
-	std::size_t m_capacity;
+	template<std::size_t... I>
+	reference row(std::size_t index, std::index_sequence<I...>) const
+	{
+		return reference(std::get<I>(m_columns)[index]...);
+	}
+
+	template<std::size_t... I>
+	void reserve_all(std::size_t capacity, std::index_sequence<I...>)
+	{
+		// Grow all columns like a Vector would, before any of them
+		// gets the new record.
+		int expand[] = {(grow(std::get<I>(m_columns), capacity), 0)...};
+		(void)expand;
+	}
+
+	template<typename V>
+	static void grow(V &column, std::size_t capacity)
+	{
+		if(capacity > column.capacity()) {
+			column.reserve(std::max(capacity, DoublingGrowth::next(column.capacity())));
+		}
+	}
+
+	template<std::size_t... I>
+	void push_fields(std::index_sequence<I...>, const Fields&... values)
+	{
+		std::size_t pushed = 0;
+		try {
+			int expand[] = {(std::get<I>(m_columns).push_back(values), pushed++, 0)...};
+			(void)expand;
+		}
+		catch(...) {
+			int expand[] = {(I < pushed ? std::get<I>(m_columns).pop_back() : void(), 0)...};
+			(void)expand;
+			throw;
+		}
+	}
+
 	std::size_t m_size;
-	char *m_array;
+	std::tuple<Vector<Fields>...> m_columns;
+};
+
+
+/**
+ * The former Vector interface, with every member virtual, to measure
+ * the cost of the dynamic dispatch.
+ */
+template<typename T>
+class VirtualVector
+{
+public:
+	virtual ~VirtualVector() {}
+
+	virtual void push_back(const T &value)
+	{
+		m_vector.push_back(value);
+	}
+
+	virtual T & operator[](std::size_t index) const
+	{
+		return m_vector[index];
+	}
+
+	virtual std::size_t size() const
+	{
+		return m_vector.size();
+	}
+
+private:
+	Vector<T> m_vector;
 };
 
+template<class F>
+double measure(F f)
+{
+	auto start = std::chrono::steady_clock::now();
+	f();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count();
+}
+
+/**
+ * The loops are kept out of line, as when the vector is handed to code
+ * of another translation unit, so that the virtual calls are not
+ * devirtualized.
+ */
+template<class V>
+__attribute__((noinline)) void fill(V &v, std::size_t count)
+{
+	for(std::size_t i=0; i<count; i++) {
+		v.push_back(int(i));
+	}
+}
+
+template<class V>
+__attribute__((noinline)) long sum(const V &v)
+{
+	long total = 0;
+	for(std::size_t i=0; i<v.size(); i++) {
+		total += v[i];
+	}
+	return total;
+}
+
+template<class V>
+void bench_vector(const char *name, V &v, std::size_t count)
+{
+	long total = 0;
+	double fill_time = measure([&] {fill(v, count);});
+	double sum_time = measure([&] {total = sum(v);});
+	std::cout << "  " << name << " push_back " << fill_time << " s, sum "
+	          << sum_time << " s (" << total << ")" << std::endl;
+}
+
+/**
+ * Push count ints then sum them, through the virtual interface and
+ * through the policy-based vector with each allocator and growth.
+ */
+void bench_policies(std::size_t count)
+{
+	std::cout << "vector benchmark, " << count << " ints" << std::endl;
+	Arena arena;
+	VirtualVector<int> virtual_vector;
+	Vector<int, MallocAllocator> vector;
+	Vector<int, MallocAllocator, HalfGrowth> half;
+	Vector<int, MallocAllocator, ChunkGrowth<1 << 20>> chunk;
+	Vector<int, AlignedAllocator<>> aligned;
+	Vector<int, HugePageAllocator> huge;
+	Vector<int, ArenaAllocator> arena_vector(arena);
+	bench_vector("virtual         ", virtual_vector, count);
+	bench_vector("malloc, 2x      ", vector, count);
+	bench_vector("malloc, 1.5x    ", half, count);
+	bench_vector("malloc, +1M     ", chunk, count);
+	bench_vector("aligned, 2x     ", aligned, count);
+	bench_vector("huge pages, 2x  ", huge, count);
+	bench_vector("arena, 2x       ", arena_vector, count);
+}
+
+
+/**
+ * Build count short-lived vectors of 0 to 8 elements, with Vector and
+ * SmallVector.
+ */
+void bench_small(std::size_t count)
+{
+	long total = 0;
+	double vector_time = measure([&] {
+		for(std::size_t i=0; i<count; i++) {
+			Vector<int> v;
+			for(std::size_t j=0; j<i % 9; j++) {
+				v.push_back(int(j));
+			}
+			total += sum(v);
+		}
+	});
+	double small_time = measure([&] {
+		for(std::size_t i=0; i<count; i++) {
+			SmallVector<int> v;
+			for(std::size_t j=0; j<i % 9; j++) {
+				v.push_back(int(j));
+			}
+			total += sum(v);
+		}
+	});
+	std::cout << "small vector benchmark, " << count << " vectors of 0 to 8 ints\n"
+	          << "  Vector      " << vector_time << " s\n"
+	          << "  SmallVector " << small_time << " s (" << total << ")" << std::endl;
+}
+
+
+/**
+ * Ingest count strings (long enough to live on the heap) into a
+ * Vector: copied one by one, moved one by one, and moved with a single
+ * append.
+ */
+void bench_append(std::size_t count)
+{
+	auto source = [count] {
+		Vector<std::string> strings;
+		strings.resize(count, std::string(40, 'x'));
+		return strings;
+	};
+
+	Vector<std::string> copied_source = source(), moved_source = source(), appended_source = source();
+	Vector<std::string> copied, moved, appended;
+	double copy_time = measure([&] {
+		for(const auto &value: copied_source) {
+			copied.push_back(value);
+		}
+	});
+	double move_time = measure([&] {
+		for(auto &value: moved_source) {
+			moved.push_back(std::move(value));
+		}
+	});
+	double append_time = measure([&] {
+		appended.append(std::make_move_iterator(appended_source.begin()),
+		                std::make_move_iterator(appended_source.end()));
+	});
+	std::cout << "append benchmark, " << count << " strings\n"
+	          << "  push_back copy " << copy_time << " s\n"
+	          << "  push_back move " << move_time << " s\n"
+	          << "  append move    " << append_time << " s" << std::endl;
+}
+
+
+/**
+ * Run the bulk operations on count floats (a cache sized count keeps
+ * them compute bound) with each supported instruction set.
+ */
+void bench_simd(std::size_t count, std::size_t rounds)
+{
+	Vector<float> a, b;
+	a.resize(count, 1.0f);
+	b.resize(count, 2.0f);
+	std::cout << "SIMD benchmark, " << count << " floats x" << rounds << std::endl;
+
+	SimdIsa best = simd_isa();
+	const char *names[] = {"scalar", "sse2  ", "avx2  ", "avx512"};
+	for(int isa=int(SimdIsa::scalar); isa<=int(best); isa++) {
+		simd_force(SimdIsa(isa));
+		float total = 0;
+		double fill_time = measure([&] {for(std::size_t r=0; r<rounds; r++) a.fill(float(r));});
+		double sum_time = measure([&] {for(std::size_t r=0; r<rounds; r++) total += a.sum();});
+		double max_time = measure([&] {for(std::size_t r=0; r<rounds; r++) total += a.max();});
+		double dot_time = measure([&] {for(std::size_t r=0; r<rounds; r++) total += a.dot(b);});
+		double find_time = measure([&] {for(std::size_t r=0; r<rounds; r++) total += a.find(-1.0f) - a.begin();});
+		std::cout << "  " << names[isa] << " fill " << fill_time << " s, sum " << sum_time
+		          << " s, max " << max_time << " s, dot " << dot_time
+		          << " s, find " << find_time << " s (" << total << ")" << std::endl;
+	}
+	simd_force(best);
+}
+
+
+/**
+ * Write count ints to a MappedVector, then reopen the file and read
+ * them back, sequentially and at random.
+ */
+void bench_mapped(std::size_t count)
+{
+	const char *path = "vector_bench.bin";
+	std::remove(path);
+
+	double write_time = measure([&] {
+		MappedVector<int> mapped(path);
+		for(std::size_t i=0; i<count; i++) {
+			mapped.push_back(int(i));
+		}
+	});
+
+	long total = 0;
+	double open_time = measure([&] {MappedVector<int> mapped(path); total += mapped.size();});
+	double sequential_time = measure([&] {
+		MappedVector<int> mapped(path);
+		mapped.advise(MADV_SEQUENTIAL);
+		for(int value: mapped) {
+			total += value;
+		}
+	});
+	double random_time = measure([&] {
+		MappedVector<int> mapped(path);
+		mapped.advise(MADV_RANDOM);
+		std::size_t index = 0;
+		for(std::size_t i=0; i<count / 100; i++) {
+			index = (index * 6364136223846793005ul + 1442695040888963407ul) % count;
+			total += mapped[index];
+		}
+	});
+	std::remove(path);
+
+	std::cout << "mapped vector benchmark, " << count << " ints\n"
+	          << "  push_back         " << write_time << " s\n"
+	          << "  reopen            " << open_time << " s\n"
+	          << "  sequential read   " << sequential_time << " s\n"
+	          << "  random read (1%)  " << random_time << " s (" << total << ")" << std::endl;
+}
+
+
+/**
+ * Append count ints from several threads, to a ConcurrentVector and to
+ * a Vector protected by a mutex.
+ */
+void bench_concurrent(std::size_t count)
+{
+	std::size_t threads = std::max(4u, std::thread::hardware_concurrency());
+	auto run = [&](auto push) {
+		return measure([&] {
+			Vector<std::thread> workers;
+			for(std::size_t t=0; t<threads; t++) {
+				workers.emplace_back([&, t] {
+					for(std::size_t i=t; i<count; i+=threads) {
+						push(int(i));
+					}
+				});
+			}
+			for(auto &worker: workers) {
+				worker.join();
+			}
+		});
+	};
+
+	ConcurrentVector<int> concurrent;
+	Vector<int> locked;
+	std::mutex mutex;
+	double concurrent_time = run([&](int value) {concurrent.push_back(value);});
+	double locked_time = run([&](int value) {
+		std::lock_guard<std::mutex> lock(mutex);
+		locked.push_back(value);
+	});
+
+	std::cout << "concurrent vector benchmark, " << count << " ints, " << threads << " threads, "
+	          << std::thread::hardware_concurrency() << " cores\n"
+	          << "  ConcurrentVector " << concurrent_time << " s\n"
+	          << "  Vector + mutex   " << locked_time << " s" << std::endl;
+}
+
+
+/**
+ * Time each of count appends to V: total time and slowest append.
+ */
+template<typename V, typename T>
+void bench_latency(const char *name, std::size_t count, const T &value)
+{
+	V v;
+	double slowest = 0;
+	double total = measure([&] {
+		for(std::size_t i=0; i<count; i++) {
+			auto start = std::chrono::steady_clock::now();
+			v.push_back(value);
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			slowest = std::max(slowest, elapsed.count());
+		}
+	});
+	std::cout << "  " << name << " total " << total << " s, slowest append "
+	          << slowest * 1e3 << " ms" << std::endl;
+}
+
+/**
+ * Compare the appends of Vector and SegmentedVector, whose segments
+ * never move.
+ */
+void bench_segmented(std::size_t count)
+{
+	std::cout << "segmented vector benchmark, " << count << " appends" << std::endl;
+	bench_latency<Vector<int>>("Vector<int>                 ", count, 1);
+	bench_latency<SegmentedVector<int>>("SegmentedVector<int>        ", count, 1);
+	bench_latency<Vector<std::string>>("Vector<std::string>         ", count / 10, std::string("event"));
+	bench_latency<SegmentedVector<std::string>>("SegmentedVector<std::string>", count / 10, std::string("event"));
+}
+
+
+/**
+ * Sum one field of count 64 byte records, stored as an array of
+ * structures and as a structure of arrays.
+ */
+void bench_soa(std::size_t count)
+{
+	struct Record
+	{
+		int key;
+		float weight;
+		double position[3];
+		char name[28];
+	};
+
+	Vector<Record> records;
+	SoAVector<int, float, double, double, double> columns;
+	records.reserve(count);
+	columns.reserve(count);
+	for(std::size_t i=0; i<count; i++) {
+		records.push_back(Record{int(i % 1000), 1.0f, {0, 0, 0}, ""});
+		columns.push_back(int(i % 1000), 1.0f, 0, 0, 0);
+	}
+
+	long total = 0;
+	double aos_time = measure([&] {
+		for(std::size_t i=0; i<records.size(); i++) {
+			total += records[i].key;
+		}
+	});
+	double soa_time = measure([&] {
+		for(int key: columns.column<0>()) {
+			total += key;
+		}
+	});
+	double rows_time = measure([&] {
+		for(auto row: columns) {
+			total += std::get<0>(row);
+		}
+	});
+	std::cout << "structure of arrays benchmark, " << count << " records of " << sizeof(Record) << " bytes\n"
+	          << "  array of structures " << aos_time << " s\n"
+	          << "  column span         " << soa_time << " s\n"
+	          << "  row iterator        " << rows_time << " s (" << total << ")" << std::endl;
+}
+
+
+/**
+ * Push count ints to vectors without and with statistics.
+ */
+void bench_stats(std::size_t count)
+{
+	Vector<int, MallocAllocator, DoublingGrowth, NoVectorStats> plain;
+	Vector<int, MallocAllocator, DoublingGrowth, AtomicVectorStats> counted;
+	double plain_time = measure([&] {fill(plain, count);});
+	double counted_time = measure([&] {fill(counted, count);});
+	std::cout << "statistics benchmark, " << count << " ints\n"
+	          << "  NoVectorStats     " << plain_time << " s\n"
+	          << "  AtomicVectorStats " << counted_time << " s" << std::endl;
+}
+
+
+/**
+ * Compare the kernels of each supported instruction set with the
+ * scalar ones, on every size up to 200 elements and at unaligned
+ * offsets. Floating point sums may only differ by their rounding.
+ */
+template<typename T>
+std::size_t check_kernels()
+{
+	std::size_t errors = 0;
+	Vector<T> values, others;
+	for(std::size_t i=0; i<203; i++) {
+		values.push_back(T(std::rand() % 100));
+		others.push_back(T(std::rand() % 100));
+	}
+	errors += reinterpret_cast<std::uintptr_t>(values.begin()) % 64 != 0;
+
+	SimdIsa best = simd_isa();
+	for(int isa=int(SimdIsa::sse2); isa<=int(best); isa++) {
+		simd_force(SimdIsa(isa));
+		for(std::size_t offset=0; offset<3; offset++) {
+			for(std::size_t count=0; count<=200; count++) {
+				const T *src = values.begin() + offset;
+				const T *other = others.begin() + offset;
+				T sum = simd_dispatch<T>([&](auto kernels) {return kernels.sum(src, count);});
+				T dot = simd_dispatch<T>([&](auto kernels) {return kernels.dot(src, other, count);});
+				T reference = ScalarKernels::sum(src, count);
+				errors += std::abs(double(sum) - double(reference)) > 1e-3 * std::abs(double(reference));
+				reference = ScalarKernels::dot(src, other, count);
+				errors += std::abs(double(dot) - double(reference)) > 1e-3 * std::abs(double(reference));
+				errors += simd_dispatch<T>([&](auto kernels) {return kernels.min(src, count);}) != ScalarKernels::min(src, count);
+				errors += simd_dispatch<T>([&](auto kernels) {return kernels.max(src, count);}) != ScalarKernels::max(src, count);
+				errors += simd_dispatch<T>([&](auto kernels) {return kernels.find(src, count, T(42));}) != ScalarKernels::find(src, count, T(42));
+			}
+		}
+
+		Vector<T> filled;
+		filled.resize(101);
+		filled.fill(T(3));
+		filled.transform([](auto x) {return x * 2 + 1;});
+		errors += filled.sum() != T(707) || filled.min() != T(7) || filled.max() != T(7);
+		errors += filled.find(T(7)) != filled.begin() || filled.find(T(3)) != filled.end();
+	}
+	simd_force(best);
+	return errors;
+}
 
 
 /**
  * A small test case
  */
-int main(void) {
+int main(int argc, char **argv) {
+	if (argc > 1 && std::string(argv[1]) == "bench") {
+		std::size_t count = argc > 2 ? std::stoul(argv[2]) : 100000000;
+		bench_policies(count);
+		bench_small(count / 10);
+		bench_append(count / 10);
+		bench_simd(4096, count / 100);
+		bench_mapped(count);
+		bench_concurrent(count);
+		bench_segmented(count);
+		bench_soa(count / 10);
+		bench_stats(count);
+		return 0;
+	}
+
 	//---------------------------------------
 	std::cout << "Vector 1 Test" << std::endl;
 	Vector<int> v1;
@@ -261,5 +3302,251 @@ int main(void) {
 	}
 	std::cout << std::endl;
 
-	return 0;
+	//--------------------------------------
+	// Relocation of elements which are not trivially relocatable (long
+	// strings own a heap buffer), and of a large trivial buffer grown
+	// by realloc.
+	std::cout << "Vector relocation Test" << std::endl;
+	std::size_t errors = 0;
+	Vector<std::string> strings;
+	for(std::size_t i=0; i<1000; i++) {
+		strings.push_back(std::string(32, 'a' + i % 26));
+	}
+	for(std::size_t i=0; i<strings.size(); i++) {
+		errors += strings[i] != std::string(32, 'a' + i % 26);
+	}
+
+	Vector<std::size_t> large;
+	for(std::size_t i=0; i<(1 << 24); i++) {
+		large.push_back(i);
+	}
+	for(std::size_t i=0; i<large.size(); i++) {
+		errors += large[i] != i;
+	}
+
+	//--------------------------------------
+	// Every allocator and growth policy.
+	std::cout << "Vector policies Test" << std::endl;
+	Arena arena(4096);
+	Vector<std::string, ArenaAllocator, HalfGrowth> arena_strings(arena);
+	Vector<int, AlignedAllocator<128>, ChunkGrowth<100>> aligned;
+	Vector<int, HugePageAllocator, HalfGrowth> huge;
+	Vector<int, ArenaAllocator> arena_ints(arena);
+	for(std::size_t i=0; i<100000; i++) {
+		arena_strings.push_back(std::to_string(i));
+		aligned.push_back(int(i));
+		huge.push_back(int(i));
+		arena_ints.push_back(int(i));
+	}
+	Vector<int, HugePageAllocator, HalfGrowth> huge_copy(huge);
+	errors += reinterpret_cast<std::uintptr_t>(aligned.begin()) % 128 != 0;
+	for(std::size_t i=0; i<100000; i++) {
+		errors += arena_strings[i] != std::to_string(i);
+		errors += aligned[i] != int(i) || huge[i] != int(i) || arena_ints[i] != int(i);
+		errors += huge_copy[i] != int(i);
+	}
+
+	//--------------------------------------
+	// Small vectors: inline up to N elements, then on the heap, moved
+	// and copied in both states.
+	std::cout << "SmallVector Test" << std::endl;
+	SmallVector<std::string, 4> small;
+	errors += !small.is_inline() || small.capacity() != 4;
+	for(std::size_t i=0; i<4; i++) {
+		small.push_back(std::string(32, 'a' + i));
+	}
+	SmallVector<std::string, 4> small_copy(small);
+	SmallVector<std::string, 4> small_moved(std::move(small_copy));
+	errors += !small_moved.is_inline() || small_moved.size() != 4 || small_copy.size() != 0;
+	small.push_back(std::string(32, 'e'));
+	errors += small.is_inline() || small.size() != 5;
+	small_copy = std::move(small);
+	errors += small_copy.is_inline() || small.size() != 0 || !small.is_inline();
+	small = std::move(small_moved);
+	for(std::size_t i=0; i<5; i++) {
+		errors += small_copy[i] != std::string(32, 'a' + i) || (i < 4 && small[i] != small_copy[i]);
+	}
+
+	//--------------------------------------
+	// Append paths: elements of the vector pushed while it grows, bulk
+	// append and insert, resize and shrink.
+	std::cout << "Vector append Test" << std::endl;
+	Vector<std::string> words;
+	words.push_back(std::string(32, 'a'));
+	for(std::size_t i=0; i<10; i++) {
+		words.push_back(words[0]);
+		words.emplace_back(words.size(), 'b');
+	}
+	errors += words.size() != 21 || words[20] != std::string(20, 'b') || words[19] != words[0];
+	std::string tail[] = {"x", "y", "z"};
+	words.append(tail, tail + 3);
+	words.insert(words.begin() + 1, tail, tail + 2);
+	words.insert(words.cbegin(), std::string("first"));
+	errors += words.size() != 27 || words[0] != "first" || words[2] != "x" || words[3] != "y";
+	errors += words[4] != words[1] || words[5] != std::string(2, 'b') || words[26] != "z";
+	words.resize(30);
+	errors += words.size() != 30 || !words[29].empty();
+	words.resize(2, words[1]);
+	words.resize(4, words[1]);
+	errors += words.size() != 4 || words[3] != std::string(32, 'a');
+	words.shrink_to_fit();
+	errors += words.capacity() != 4 || words[1] != words[2];
+	Vector<std::string> taken;
+	taken = std::move(words);
+	taken.resize(0);
+	taken.shrink_to_fit();
+	errors += words.size() != 0 || taken.size() != 0 || taken.capacity() != 0;
+
+	Vector<Vector<int>> nested;
+	nested.emplace_back(v1);
+	nested.push_back(Vector<int>(v1));
+	errors += nested.size() != 2 || nested[1].size() != v1.size() || nested[0][3] != 3;
+
+	//--------------------------------------
+	// SIMD bulk operations, on each supported instruction set.
+	std::cout << "Vector SIMD Test" << std::endl;
+	errors += check_kernels<float>() + check_kernels<double>() + check_kernels<int>();
+	errors += check_kernels<std::uint8_t>() + check_kernels<std::int64_t>();
+	Vector<double> row, column;
+	row.resize(1000, 0.5);
+	column.resize(1000, 4.0);
+	errors += row.dot(column) != 2000.0;
+
+	//--------------------------------------
+	// Mapped vector: content kept across reopenings, bad files refused.
+	std::cout << "MappedVector Test" << std::endl;
+	const char *path = "vector_test.bin";
+	std::remove(path);
+	{
+		MappedVector<std::size_t> mapped(path);
+		for(std::size_t i=0; i<100000; i++) {
+			mapped.push_back(i);
+		}
+		mapped.push_back(mapped[7]);
+	}
+	{
+		MappedVector<std::size_t> mapped(path);
+		errors += mapped.size() != 100001 || mapped[100000] != 7;
+		for(std::size_t i=0; i<100000; i++) {
+			errors += mapped[i] != i;
+		}
+		mapped.append(large.begin(), large.begin() + 10);
+		mapped.resize(100020);
+		errors += mapped[100010] != 9 || mapped[100019] != 0;
+	}
+	try {
+		MappedVector<int> mismatch(path);
+		errors++;
+	}
+	catch(const std::runtime_error &) {
+	}
+	errors += MappedVector<std::size_t>(path).size() != 100020;
+	std::remove(path);
+
+	//--------------------------------------
+	// Concurrent vector: writers appending while a reader visits the
+	// published elements, addresses kept.
+	std::cout << "ConcurrentVector Test" << std::endl;
+	ConcurrentVector<std::size_t> events;
+	events.push_back(0);
+	const std::size_t *first = &events[0];
+	std::atomic<bool> writing(true);
+	Vector<std::thread> writers;
+	for(std::size_t t=0; t<4; t++) {
+		writers.emplace_back([&events, t] {
+			for(std::size_t i=1; i<=50000; i++) {
+				events.push_back(t * 1000000 + i);
+			}
+		});
+	}
+	std::thread reader([&] {
+		while(writing) {
+			events.visit([&](std::size_t index, std::size_t value) {
+				errors += (index == 0) != (value == 0) || value % 1000000 > 50000;
+			});
+		}
+	});
+	for(auto &writer: writers) {
+		writer.join();
+	}
+	writing = false;
+	reader.join();
+
+	Vector<std::size_t> collected;
+	events.visit([&](std::size_t, std::size_t value) {collected.push_back(value);});
+	std::sort(collected.begin(), collected.end());
+	errors += events.size() != 200001 || collected.size() != 200001 || &events[0] != first;
+	for(std::size_t i=1; i<collected.size(); i++) {
+		errors += collected[i] != (i - 1) / 50000 * 1000000 + (i - 1) % 50000 + 1;
+	}
+
+	//--------------------------------------
+	// Segmented vector: stable addresses across segments, iteration.
+	std::cout << "SegmentedVector Test" << std::endl;
+	SegmentedVector<std::string> segmented;
+	segmented.push_back(std::string(32, 'a'));
+	const std::string *front = &segmented[0];
+	for(std::size_t i=1; i<10000; i++) {
+		segmented.emplace_back(std::to_string(i));
+	}
+	errors += &segmented[0] != front || segmented.size() != 10000 || segmented.capacity() < 10000;
+	std::size_t visited = 0;
+	segmented.visit([&](const std::string &value) {
+		errors += visited > 0 && value != std::to_string(visited);
+		visited++;
+	});
+	errors += visited != 10000 || segmented.end() - segmented.begin() != 10000;
+	errors += std::find(segmented.begin(), segmented.end(), "9999") != segmented.end() - 1;
+	SegmentedVector<double> reserved;
+	reserved.reserve(1000);
+	reserved.push_back(1.0);
+	errors += reserved.capacity() < 1000 || reinterpret_cast<std::uintptr_t>(&reserved[0]) % 64 != 0;
+
+	//--------------------------------------
+	// Structure of arrays: aligned columns, rows zipped back.
+	std::cout << "SoAVector Test" << std::endl;
+	SoAVector<int, std::string, double> table;
+	for(std::size_t i=0; i<1000; i++) {
+		table.push_back(int(i), std::to_string(i), i * 0.5);
+	}
+	std::get<2>(table.row(10)) = -1.0;
+	table.get<0>(11) = -11;
+	Span<double> positions = table.column<2>();
+	errors += table.size() != 1000 || positions.size() != 1000 || positions[10] != -1.0;
+	errors += reinterpret_cast<std::uintptr_t>(positions.data()) % 64 != 0;
+	std::size_t row_index = 0;
+	for(auto row: table) {
+		int key = std::get<0>(row);
+		errors += std::get<1>(row) != std::to_string(row_index);
+		errors += row_index == 11 ? key != -11 : key != int(row_index);
+		row_index++;
+	}
+	errors += row_index != 1000 || table.end() - table.begin() != 1000;
+	errors += !(table.begin() < table.end()) || !(table.end() > table.begin());
+	errors += !(table.begin() <= table.begin()) || !(table.end() >= table.begin() + 1000);
+
+	//--------------------------------------
+	// Statistics, counted for a type of its own.
+	std::cout << "Vector statistics Test" << std::endl;
+	struct Sample
+	{
+		short value;
+	};
+	{
+		Vector<Sample, MallocAllocator, DoublingGrowth, AtomicVectorStats> samples;
+		for(short i=0; i<1000; i++) {
+			samples.push_back(Sample{i});
+		}
+		Vector<Sample, MallocAllocator, DoublingGrowth, AtomicVectorStats> unused;
+		unused.reserve(16);
+		unused.shrink_to_fit();
+	}
+	VectorTypeStats &sample_stats = AtomicVectorStats::of<Sample>();
+	errors += sample_stats.allocations != 2 || sample_stats.reallocations != 10;
+	errors += sample_stats.relocated_bytes != 1023 * sizeof(Sample) || sample_stats.peak_capacity_bytes != 1024 * sizeof(Sample);
+	errors += sample_stats.destroyed != 2 || sample_stats.wasted_bytes != 40 * sizeof(Sample);
+
+	std::cout << errors << " errors" << std::endl;
+
+	return errors != 0;
 }